@@ -20,22 +20,32 @@
 
 #include "Android.mk.h"
 #include <vector>
-#include <sstream>
 #include "nom/src/lexer.hpp"
 #include "shared/SSources.h"
+#include "shared/str_utils.h"
 
-std::string AndroidMk_replace_LOCAL_SRC_FILES(const std::string& mk, const std::string& newSrc) {
-    std::ostringstream os;
+bool AndroidMk_modules(const std::string& mk, std::vector<AndroidMkModule>& modules) {
+    modules.assign(1, AndroidMkModule());
+    const char* base = mk.c_str();
     
-    MakefileLexer l("test", mk.c_str());
+    MakefileLexer l("Android.mk", base);
     
     const std::string LOCAL_SRC_FILES("LOCAL_SRC_FILES");
+    const std::string LOCAL_MODULE("LOCAL_MODULE");
     
     std::string assignName;
     Token::Type expectToken = Token::Literal;
     bool isMatching = false;
     bool firstMatching = true;
     bool running = true;
+    // the current module has its include $(CLEAR_VARS)
+    bool cleared = false;
+    // after the first literal and after the assignment operator of the line
+    const char* nameEnd = NULL;
+    const char* valueBegin = NULL;
+    // first token of the range being removed
+    const char* matchBegin = NULL;
+    bool matchFirst = false;
     
     while (running) {
         Token token = l.next();
@@ -43,10 +53,11 @@ std::string AndroidMk_replace_LOCAL_SRC_FILES(const std::string& mk, const std::
         
         switch (token.type) {
             case Token::ParseError:
-                return "";
+                return false;
                 
             case Token::Eof:
                 running = false;
+                token.begin = base + mk.length();
                 break;
                 
             case Token::Empty:
@@ -56,17 +67,34 @@ std::string AndroidMk_replace_LOCAL_SRC_FILES(const std::string& mk, const std::
                 break;
                 
             case Token::Eol:
+                if (valueBegin && assignName == LOCAL_MODULE && modules.back().name.empty()) {
+                    std::string name(valueBegin, token.begin - valueBegin);
+                    trim(name);
+                    modules.back().name = name;
+                } else if (!valueBegin && assignName == "include") {
+                    std::string value(nameEnd, token.begin - nameEnd);
+                    trim(value);
+                    if (value == "$(CLEAR_VARS)" || value == "${CLEAR_VARS}") {
+                        if (cleared) {
+                            modules.push_back(AndroidMkModule());
+                            firstMatching = true;
+                        }
+                        cleared = true;
+                    }
+                }
                 expectToken = Token::Literal;
+                valueBegin = NULL;
                 if (isMatching) {
                     firstMatching = false;
                     isMatching = false;
-                    assignName.clear();
                 }
+                assignName.clear();
                 break;
                 
             case Token::Literal:
                 if (expectToken == Token::Literal) {
                     assignName.assign(token.begin, token.end - token.begin);
+                    nameEnd = token.end;
                     //printf("Literal:%s\n", assignName.c_str());
                     if (!firstMatching) {
                         isMatching = (assignName == LOCAL_SRC_FILES);
@@ -85,6 +113,7 @@ std::string AndroidMk_replace_LOCAL_SRC_FILES(const std::string& mk, const std::
             case Token::Operator:
                 if (expectToken == Token::Operator) {
                     isMatching = (assignName == LOCAL_SRC_FILES);
+                    valueBegin = token.end;
                     expectToken = Token::Eol;
                 }
                 break;
@@ -98,17 +127,47 @@ std::string AndroidMk_replace_LOCAL_SRC_FILES(const std::string& mk, const std::
                 break;
         }
         
-        if (isMatching) {
-            if (firstMatching) {
+        if (isMatching && running) {
+            if (!matchBegin) {
+                matchBegin = token.begin;
+                matchFirst = firstMatching;
                 firstMatching = false;
-                os << ":= \\\n" << newSrc;
             }
-        } else {
-            os << std::string(token.begin, token.end - token.begin);
+        } else if (matchBegin) {
+            modules.back().ranges.push_back({(size_t)(matchBegin - base), (size_t)(token.begin - base), matchFirst});
+            matchBegin = NULL;
         }
         //printf("%s\n", token.dump().c_str());
     }
-    //printf("%s\n", os.str().c_str());
 
-    return os.str();
+    return true;
+}
+
+std::string AndroidMk_replace_LOCAL_SRC_FILES(const std::string& mk, const std::vector<AndroidMkModule>& modules, const std::vector<const std::string*>& newSrcs) {
+    size_t length = mk.length();
+    for (size_t i = 0; i < newSrcs.size(); ++i) {
+        length += newSrcs[i] ? newSrcs[i]->length() + 4 : 0;
+    }
+    std::string out;
+    out.reserve(length);
+    
+    // untouched bytes between ranges are copied in one piece
+    size_t copied = 0;
+    for (size_t i = 0; i < modules.size() && i < newSrcs.size(); ++i) {
+        if (!newSrcs[i]) {
+            continue;
+        }
+        const auto& ranges = modules[i].ranges;
+        for (auto iter = ranges.begin(); iter != ranges.end(); ++iter) {
+            out.append(mk, copied, iter->begin - copied);
+            if (iter->first) {
+                out.append(":= \\\n");
+                out.append(*newSrcs[i]);
+            }
+            copied = iter->end;
+        }
+    }
+    out.append(mk, copied, std::string::npos);
+
+    return out;
 }
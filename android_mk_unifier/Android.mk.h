@@ -21,7 +21,28 @@
 #ifndef Android_mk_h__
 #define Android_mk_h__
 #include <string>
+#include <vector>
 
-std::string AndroidMk_replace_LOCAL_SRC_FILES(const std::string& mk, const std::string& newSrc);
+// a module of Android.mk, from its include $(CLEAR_VARS) to the next one,
+// the first one starts at the beginning of the file
+struct AndroidMkModule {
+    // LOCAL_MODULE, empty when not set
+    std::string name;
+
+    // byte range of LOCAL_SRC_FILES to remove, the first one of the module
+    // is from its operator and gets the new sources
+    struct Range {
+        size_t begin;
+        size_t end;
+        bool first;
+    };
+    std::vector<Range> ranges;
+};
+
+// finds the modules of mk in one lexer pass, false on parse error
+bool AndroidMk_modules(const std::string& mk, std::vector<AndroidMkModule>& modules);
+
+// replaces LOCAL_SRC_FILES of modules[i] by newSrcs[i], modules with NULL are kept
+std::string AndroidMk_replace_LOCAL_SRC_FILES(const std::string& mk, const std::vector<AndroidMkModule>& modules, const std::vector<const std::string*>& newSrcs);
 
 #endif//Android_mk_h__
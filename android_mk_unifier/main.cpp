@@ -19,13 +19,19 @@
 // SOFTWARE.
 
 #include "shared/SSources.h"
-#include <sstream>
 #include <string>
 #include <vector>
+#include <memory>
 //#include <regex>
 #include <stdio.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include <shared/utils/Path.h>
+#include <shared/utils/ParallelFor.h>
 #include "Android.mk.h"
 #include "shared/str_utils.h"
 #include "shared/file_utils.h"
@@ -36,72 +42,249 @@ struct SAndroidSources : SSources {
     static constexpr const char* Unified_RelativeRoot = "../../";
 
 public:
-    SAndroidSources() {
+    // unified files of a module with its own list are in a dir of the module
+    explicit SAndroidSources(const std::string& module = std::string()) {
         _unified_Path = Unified_Path;
         _unified_RelativeRoot = Unified_RelativeRoot;
+        if (!module.empty()) {
+            _unified_Path.append(getClearFileName(module.c_str()));
+            _unified_Path.push_back('/');
+            _unified_RelativeRoot.append("../");
+        }
 
         addExt(".c");
         addExt(".cpp");
         addExt(".cxx");
     }
 
-    bool load(const char* root);
-    bool makeAndroidMK() const;
-};
+    // LOCAL_SRC_FILES value of the sources
+    std::string localSrcFiles() const;
 
-bool SAndroidSources::load(const char* root) {
-    if (!SSources::load(root, "Android.list")) {
-        LOG_E("Build %s failed!\n", root);
-        return false;
+    const std::string& unifiedPath() const {
+        return _unified_Path;
     }
+};
 
-    return makeAndroidMK();
+std::string SAndroidSources::localSrcFiles() const {
+    std::string src;
+    size_t length = 0;
+    for (auto iter = _files.begin(); iter != _files.end(); ++iter) {
+        length += iter->length() + 7;
+    }
+    src.reserve(length);
+    for (auto iter = _files.begin(); iter != _files.end(); ++iter) {
+        src.append("    ");
+        src.append(*iter);
+        src.append(" \\\n");
+    }
+    return src;
 }
 
-bool SAndroidSources::makeAndroidMK() const {
+// unifies the modules of an Android.mk, a module with Android.<LOCAL_MODULE>.list
+// gets the sources of it, the first module without one gets Android.list
+struct SAndroidMk {
+    static constexpr const char* Stamp_Name = "@unified_build.android.stamp";
+
+    SAndroidMk() : _unified(true), _longestFirst(false), _stats(false), _dirCache(NULL), _upToDate(false) {
+    }
+
+    bool make(const char* root);
+
+    // nothing read or written by the last run changed, make() did nothing
+    bool upToDate() const {
+        return _upToDate;
+    }
+
+    bool _unified;
+    bool _longestFirst;
+    bool _stats;
+    // shared by the Android.mk made in parallel, NULL for none
+    SDirCache* _dirCache;
+    // stats of all modules made
+    SSources _total;
+
+private:
+    bool _upToDate;
+};
+
+bool SAndroidMk::make(const char* root) {
+    shared::Path stampPath(root, Stamp_Name);
+    shared::StrBuf stampHeader;
+    stampHeader.appendf("android_mk_unifier %s unified=%d longest=%d", CPP_BUILD_UNIFIER_VERSION, _unified ? 1 : 0, _longestFirst ? 1 : 0);
+    FileStamp stamp(std::string(stampHeader.c_str(), stampHeader.length()));
+    if (stamp.unchanged(stampPath.c_str())) {
+        LOG_I("Unchanged %s\n", root);
+        _upToDate = true;
+        return true;
+    }
+
     std::string content;
-    std::string mkFileName = _root + "Android.mk";
+    shared::Path mkFileName(root, "Android.mk");
     if (!loadContent(mkFileName.c_str(), content) || content.length() == 0) {
         LOG_E("Unable to load %s\n", mkFileName.c_str());
         return false;
     }
-    
-    std::ostringstream os;
-    for (auto iter = _files.begin(); iter != _files.end(); ++iter) {
-        os << "    " << *iter << " \\\n";
-    }
-    
-    std::string replaced = AndroidMk_replace_LOCAL_SRC_FILES(content, os.str());
-    if (replaced.length() == 0) {
+    std::vector<AndroidMkModule> modules;
+    if (!AndroidMk_modules(content, modules)) {
         LOG_E("Parsing %s error\n", mkFileName.c_str());
         return false;
     }
 
-    return saveContentWithCheck(mkFileName.c_str(), replaced);
+    std::vector<std::unique_ptr<SAndroidSources>> srcs(modules.size());
+    std::vector<std::string> newSrcs(modules.size());
+    std::vector<const std::string*> replaces(modules.size(), NULL);
+    bool anyList = false;
+    bool defaultList = false;
+    for (size_t i = 0; i < modules.size(); ++i) {
+        const std::string& name = modules[i].name;
+        std::string list;
+        if (!name.empty()) {
+            list = "Android." + name + ".list";
+            shared::Path listPath(root, list.c_str());
+            stamp.add(listPath.string());
+            if (access(listPath.c_str(), F_OK) != 0) {
+                list.clear();
+            }
+        }
+        if (list.empty()) {
+            if (defaultList || modules[i].ranges.empty()) {
+                continue;
+            }
+            defaultList = true;
+        } else if (modules[i].ranges.empty()) {
+            // nothing to put the sources in
+            LOG_W("Skip module %s of %s without LOCAL_SRC_FILES\n", name.c_str(), list.c_str());
+            continue;
+        }
+        srcs[i].reset(new SAndroidSources(list.empty() ? std::string() : name));
+        SAndroidSources& src = *srcs[i];
+        src.setUnified(_unified);
+        src.setLongestFirst(_longestFirst);
+        src.setDirCache(_dirCache);
+        if (modules.size() > 1) {
+            LOG_W_ONLY(ELogLevel::Print(stdout, "========== %s ==========\n", list.empty() ? "Android.list" : name.c_str()));
+        }
+        if (!src.load(root, list.empty() ? "Android.list" : list.c_str())) {
+            if (list.empty()) {
+                stamp.add(shared::Path(root, "Android.list").string());
+                continue;
+            }
+            return false;
+        }
+        if (_stats) {
+            src.printStats();
+        }
+        _total.mergeStats(src);
+        stamp.add(src.inputs().begin(), src.inputs().end());
+        stamp.addSize(src.sizedInputs().begin(), src.sizedInputs().end());
+        stamp.add(shared::Path(root, src.unifiedPath().c_str()).string());
+        newSrcs[i] = src.localSrcFiles();
+        replaces[i] = &newSrcs[i];
+        anyList = true;
+    }
+    if (!anyList) {
+        LOG_E("No list for %s\n", mkFileName.c_str());
+        return false;
+    }
+
+    std::string replaced = AndroidMk_replace_LOCAL_SRC_FILES(content, modules, replaces);
+    if (replaced != content && !saveContent(mkFileName.c_str(), replaced)) {
+        return false;
+    }
+
+    stamp.add(mkFileName.string());
+    stamp.add(shared::Path(root, SAndroidSources::Unified_Path).string());
+    if (!stamp.save(stampPath.c_str())) {
+        LOG_W("Unable to save %s\n", stampPath.c_str());
+    }
+    return true;
+}
+
+static bool isAndroidList(const std::string& name) {
+    return isBeginWith(name, "Android.") && isEndOf(name, ".list");
+}
+
+// dirs under path with an Android.mk and a list for it, hidden dirs, dirs of
+// unified files and links to dirs are skipped
+static void findAndroidMkDirs(const std::string& path, std::vector<std::string>& dirs) {
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        LOG_E("%s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    bool mk = false;
+    bool list = false;
+    std::vector<std::string> subs;
+    struct stat info;
+    struct dirent* item;
+    while ((item = readdir(dir)) != NULL) {
+        if (item->d_name[0] == '.' || item->d_name[0] == '@') {
+            continue;
+        }
+        shared::Path sub(path.c_str(), item->d_name);
+        if (lstat(sub.c_str(), &info) < 0) {
+            continue;
+        }
+        if (S_ISDIR(info.st_mode)) {
+            subs.push_back(sub.string());
+            continue;
+        }
+        // a linked list or Android.mk is fine
+        if (S_ISLNK(info.st_mode) && (stat(sub.c_str(), &info) < 0 || !S_ISREG(info.st_mode))) {
+            continue;
+        }
+        mk = mk || strcmp(item->d_name, "Android.mk") == 0;
+        list = list || isAndroidList(item->d_name);
+    }
+    closedir(dir);
+    if (mk && list) {
+        dirs.push_back(path);
+    }
+    std::sort(subs.begin(), subs.end());
+    for (auto iter = subs.begin(); iter != subs.end(); ++iter) {
+        findAndroidMkDirs(*iter, dirs);
+    }
 }
 
 void help(const char* cmd) {
-    printf("Android.mk unifier, v2022.0914, Copyright 2018-2022 bianchui@github.com .\n");
-    printf("usage:\n%s [-no] [dir]\n", cmd);
+    printf("Android.mk unifier, " CPP_BUILD_UNIFIER_VERSION ", Copyright 2018-2022 bianchui@github.com .\n");
+    printf("usage:\n%s [-no] [-longest] [-r] [-j N] [dir]\n", cmd);
+    printf("  a module of Android.mk is unified by Android.<LOCAL_MODULE>.list, the\n");
+    printf("  first one without a list by Android.list\n");
     printf("  -no       disable unifier\n");
+    printf("  -longest  list the files costing the most to compile first in LOCAL_SRC_FILES,\n");
+    printf("            by the sizes of their sources\n");
+    printf("  -r        all dirs under dir with Android.mk and its lists, dirs are scanned once\n");
+    printf("  -j N      run -r with N threads, default is one per cpu\n");
 }
 
 int main(const int argc, const char * argv[]) {
     const char* cwd = getcwd(NULL, 0);
     const char* srcdir = NULL;
-    bool stats = false;
-    SAndroidSources srcs;
+    bool recursive = false;
+    size_t jobs = 0;
+    SAndroidMk mk;
     for (int i = 1; i < argc; ++i) {
         if (argv[i][0] == '-') {
             if (0 == strcasecmp(argv[i] + 1, "h") || 0 == strcasecmp(argv[i] + 1, "help")) {
                 help(argv[0]);
                 return 0;
             } else if (0 == strcasecmp(argv[i] + 1, "no")) {
-                srcs.setUnified(false);
+                mk._unified = false;
+            } else if (0 == strcasecmp(argv[i] + 1, "longest")) {
+                mk._longestFirst = true;
+            } else if (0 == strcasecmp(argv[i] + 1, "r")) {
+                recursive = true;
+            } else if (argv[i][1] == 'j' && (argv[i][2] == 0 || isdigit(argv[i][2]))) {
+                const char* jobsArg = argv[i] + 2;
+                if (!*jobsArg && i + 1 < argc) {
+                    jobsArg = argv[++i];
+                }
+                jobs = (size_t)atoi(jobsArg);
             } else if (ELogLevel::ParseLogLevel(argv[i] + 1)) {
 
             } else if (0 == strcasecmp(argv[i] + 1, "stat")) {
-                stats = true;
+                mk._stats = true;
             }
         } else {
             srcdir = argv[i];
@@ -110,12 +293,57 @@ int main(const int argc, const char * argv[]) {
     if (srcdir == NULL) {
         srcdir = cwd;
     }
+    if (ELogLevel::GetLogLevel() >= ELogLevel::INFO) {
+        mk._stats = true;
+    }
     shared::Path path(cwd, srcdir);
-    if (!srcs.load(path.c_str())) {
-        return 1;
+    if (!recursive) {
+        if (!mk.make(path.c_str())) {
+            LOG_E("Build %s failed!\n", path.c_str());
+            return 1;
+        }
+        return 0;
+    }
+
+    // one process for all dirs, they share the dirs read and print stats once
+    std::vector<std::string> dirs;
+    findAndroidMkDirs(path.string(), dirs);
+    std::sort(dirs.begin(), dirs.end());
+    SDirCache dirCache;
+    const bool stats = mk._stats;
+    mk._stats = false;
+    mk._dirCache = &dirCache;
+    std::vector<SAndroidMk> mks(dirs.size(), mk);
+    std::vector<char> results(dirs.size(), 0);
+    // output of each dir is kept and printed in dir order
+    std::vector<LogBuffer> outputs(dirs.size());
+    shared::ParallelFor(dirs.size(), jobs, [&](size_t i) {
+        ELogLevel::SetThreadBuffer(&outputs[i]);
+        results[i] = mks[i].make(dirs[i].c_str());
+        ELogLevel::SetThreadBuffer(NULL);
+    });
+
+    SSources total;
+    size_t failed = 0;
+    size_t upToDate = 0;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        outputs[i].flush();
+        if (!results[i]) {
+            ++failed;
+            LOG_E("Build %s failed!\n", dirs[i].c_str());
+        } else if (mks[i].upToDate()) {
+            ++upToDate;
+        } else {
+            LOG_I("Built %s\n", dirs[i].c_str());
+        }
+        total.mergeStats(mks[i]._total);
+    }
+    if (dirs.empty()) {
+        LOG_E("No Android.mk with a list under %s\n", path.c_str());
     }
-    if (stats || ELogLevel::GetLogLevel() >= ELogLevel::INFO) {
-        srcs.printStats();
+    if (stats) {
+        printf("Android.mk: %d, unchanged: %d, failed: %d\n", (int)dirs.size(), (int)upToDate, (int)failed);
+        total.printStats();
     }
-    return 0;
+    return failed || dirs.empty() ? 1 : 0;
 }
@@ -26,6 +26,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
 #include <shared/utils/Path.h>
 #include <shared/SharedMacros.h>
 #include "str_utils.h"
@@ -33,6 +35,48 @@
 
 ELogLevel::Enum ELogLevel::g_logLevel = ELogLevel::ERROR;
 
+static thread_local LogBuffer* t_logBuffer = NULL;
+
+void LogBuffer::flush() {
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.length(), stdout);
+        out.clear();
+    }
+    if (!err.empty()) {
+        fflush(stdout);
+        fwrite(err.data(), 1, err.length(), stderr);
+        err.clear();
+    }
+}
+
+void ELogLevel::Print(FILE* stream, const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    if (t_logBuffer) {
+        char buf[1024];
+        va_list ap2;
+        va_copy(ap2, ap);
+        const int length = vsnprintf(buf, sizeof(buf), format, ap);
+        std::string& out = stream == stderr ? t_logBuffer->err : t_logBuffer->out;
+        if (length >= (int)sizeof(buf)) {
+            const size_t offset = out.length();
+            out.resize(offset + length + 1);
+            vsnprintf(&out[offset], length + 1, format, ap2);
+            out.resize(offset + length);
+        } else if (length > 0) {
+            out.append(buf, length);
+        }
+        va_end(ap2);
+    } else {
+        vfprintf(stream, format, ap);
+    }
+    va_end(ap);
+}
+
+void ELogLevel::SetThreadBuffer(LogBuffer* buffer) {
+    t_logBuffer = buffer;
+}
+
 ELogLevel::Enum ELogLevel::FromString(const char* str) {
     Enum level = ELogLevel::NONE;
     struct LevelString {
@@ -154,8 +198,39 @@ bool SSources::load(const char* root, const char* src_list) {
     if (_root.length() && _root.back() != '/') {
         _root.push_back('/');
     }
-    std::ifstream is_list((_root + src_list).c_str());
-    return load(is_list, "");
+    _inputs.push_back(_root + src_list);
+    std::ifstream is_list(_inputs.back().c_str());
+    if (!load(is_list, "")) {
+        return false;
+    }
+    if (_longestFirst) {
+        for (auto iter = _files.begin(); iter != _files.end(); ++iter) {
+            if (_costs.find(*iter) == _costs.end()) {
+                _sizedInputs.push_back(_root + *iter);
+                _costs[*iter] = fileSize(_sizedInputs.back().c_str());
+            }
+        }
+        SortByCost(_root, _files, _costs);
+    }
+    return true;
+}
+
+void SSources::SortByCost(const std::string& root, std::vector<std::string>& files, const std::map<std::string, uint64_t>& costs) {
+    std::vector<std::pair<uint64_t, std::string>> sorted;
+    sorted.reserve(files.size());
+    for (auto iter = files.begin(); iter != files.end(); ++iter) {
+        auto cost = costs.find(*iter);
+        sorted.push_back({cost != costs.end() ? cost->second : fileSize(shared::Path(root.c_str(), iter->c_str()).c_str()), *iter});
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b) {
+        if (a.first != b.first) {
+            return a.first > b.first;
+        }
+        return stricasecmp(a.second, b.second);
+    });
+    for (size_t i = 0; i < files.size(); ++i) {
+        files[i] = std::move(sorted[i].second);
+    }
 }
 
 bool SSources::load(std::istream& is_list, std::string list_relative) {
@@ -222,6 +297,7 @@ bool SSources::load(std::istream& is_list, std::string list_relative) {
 bool SSources::mergelist(const char* list, const std::string& relative) {
     shared::Path re_list(relative.c_str(), list);
     shared::Path path(_root.c_str(), re_list.c_str());
+    _inputs.push_back(path.string());
     std::ifstream is_list(path.c_str());
     std::string dir = re_list.dir();
     LOG_D("MergeList:%s relative %s\n", re_list.c_str(), dir.c_str());
@@ -265,43 +341,87 @@ void SSources::ensureUnifiedDir() {
     }
 }
 
+bool SDirCache::Read(const std::string& path, std::vector<Entry>& entries) {
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        LOG_E("%s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat info;
+    struct dirent* item;
+    while ((item = readdir(dir)) != NULL) {
+        if (item->d_name[0] == '.') {
+            continue;
+        }
+        Entry entry;
+        entry.name = item->d_name;
+        shared::Path sub(path.c_str(), item->d_name);
+        entry.error = stat(sub.c_str(), &info) < 0;
+        if (entry.error) {
+            LOG_E("%s: %s\n", sub.c_str(), strerror(errno));
+        }
+        entry.dir = !entry.error && S_ISDIR(info.st_mode);
+        entry.file = !entry.error && S_ISREG(info.st_mode);
+        entries.push_back(std::move(entry));
+    }
+    closedir(dir);
+    return true;
+}
+
+bool SDirCache::list(const std::string& path, const std::vector<Entry>*& entries) {
+    std::string key = path;
+    if (key.length() > 1 && key.back() == '/') {
+        key.pop_back();
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto iter = _dirs.find(key);
+        if (iter != _dirs.end()) {
+            entries = &iter->second.second;
+            return iter->second.first;
+        }
+    }
+    // read unlocked, the first one read is kept
+    std::pair<bool, std::vector<Entry>> dir;
+    dir.first = Read(key, dir.second);
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto iter = _dirs.insert(std::make_pair(key, std::move(dir))).first;
+    entries = &iter->second.second;
+    return iter->second.first;
+}
+
 bool SSources::addDir(SUnifyUnit& bu, const std::string& path, bool recursive) {
     ++_stats.scanDirs;
     //std::string dirname = getDirName(path.c_str());
-    struct stat info;
     
-    DIR* dir = opendir(shared::Path(_root.c_str(), path.c_str()).c_str());
-    if (!dir) {
-        LOG_E_ONLY(perror(path.c_str()));
+    _inputs.push_back(shared::Path(_root.c_str(), path.c_str()).string());
+    std::vector<SDirCache::Entry> read;
+    const std::vector<SDirCache::Entry>* entries = &read;
+    if (_dirCache ? !_dirCache->list(_inputs.back(), entries) : !SDirCache::Read(_inputs.back(), read)) {
         ++_stats.scanErrors;
         return false;
     }
-    struct dirent* item;
     std::string subpath;
     bool success = true;
-    while (success && (item = readdir(dir)) != NULL) {
-        if (item->d_name[0] == '.') {
-            continue;
-        }
-        subpath = path + item->d_name;
-        if (stat(shared::Path(_root.c_str(), subpath.c_str()).c_str(), &info) < 0) {
-            LOG_E_ONLY(perror(subpath.c_str()));
+    for (auto item = entries->begin(); success && item != entries->end(); ++item) {
+        subpath = path + item->name;
+        if (item->error) {
             ++_stats.scanErrors;
             continue;
         }
         if (isExclude(subpath.c_str())) {
             //LOG_V("Exclude:%s\n", subpath.c_str());
-            if (S_ISREG(info.st_mode)) {
+            if (item->file) {
                 ++_stats.scanFiles;
                 ++_stats.excludeFiles;
-            } else if (S_ISDIR(info.st_mode)) {
+            } else if (item->dir) {
                 ++_stats.scanDirs;
                 ++_stats.excludeDirs;
             }
             continue;
         }
 
-        if (S_ISREG(info.st_mode)) {
+        if (item->file) {
             ++_stats.scanFiles;
             const char* ext = fileext(subpath.c_str());
             if (!ext) {
@@ -328,12 +448,11 @@ bool SSources::addDir(SUnifyUnit& bu, const std::string& path, bool recursive) {
 
             success = _unified ? bu.add(subpath.c_str()) : addFile(subpath.c_str());
         }
-        if (S_ISDIR(info.st_mode) && recursive) {
+        if (item->dir && recursive) {
             subpath.push_back('/');
             success = addDir(bu, subpath, recursive);
         }
     }
-    closedir(dir);
     return success;
 }
 
@@ -474,81 +593,152 @@ bool SSources::SUnifyUnit::commit() {
         }
     }
     for (auto iter = extfiles.begin(); iter != extfiles.end(); ++iter) {
-        auto& files = iter->second;
-        if (files.size() == 1) {
-            ++sources->_stats.singleFiles;
-            LOG_I("Commit:single:%s\n", files[0].c_str());
-            sources->_files.push_back(files[0]);
-        } else {
-            Stats& stats = sources->_stats;
-            stats.unifiedFiles += (uint32_t)files.size();
-            stats.minUnifyFiles = (stats.minUnifyFiles == 0 || files.size() < stats.minUnifyFiles) ? (uint32_t)files.size() : stats.minUnifyFiles;
-            stats.maxUnifyFiles = stats.maxUnifyFiles < files.size() ? (uint32_t)files.size() : stats.maxUnifyFiles;
-            sources->ensureUnifiedDir();
-            std::sort(files.begin(), files.end(), stricasecmp);
-            std::string unifiedPath;
-            int retry = 0;
-            do {
-                unifiedPath = sources->_unified_Path;
-                unifiedPath.append(getClearFileName(unifiedRoot.c_str()));
-                unifiedPath.append(iter->first);
-                if (retry) {
-                    char buf[64];
-                    sprintf(buf, "_%d", retry);
-                    unifiedPath.append(buf);
-                }
-                unifiedPath.push_back('.');
-                unifiedPath.append(iter->first);
-                ++retry;
-            } while (contains(sources->_files, unifiedPath));
-            std::ostringstream os;
-            for (auto fi = files.begin(); fi != files.end(); ++fi) {
-                os << "#include \"" << sources->_unified_RelativeRoot << *fi << "\"\n";
+        if (!sources->_fileGroups || sources->_fileGroups->empty()) {
+            if (!commitFiles(iter->first, iter->second, std::string())) {
+                return false;
             }
-            if (!saveContentWithCheck(shared::Path(sources->_root.c_str(), unifiedPath.c_str()).c_str(), os.str())) {
+            continue;
+        }
+        // no group first, then by group
+        std::map<std::string, std::vector<std::string>> groups;
+        for (auto file = iter->second.begin(); file != iter->second.end(); ++file) {
+            const std::string* group = sources->group(*file);
+            groups[group ? *group : std::string()].push_back(*file);
+        }
+        for (auto group = groups.begin(); group != groups.end(); ++group) {
+            if (!commitFiles(iter->first, group->second, group->first)) {
                 return false;
             }
-            sources->_files.push_back(unifiedPath);
-            LOG_I("Commit:unified:%s\n", unifiedPath.c_str());
         }
     }
 
     return true;
 }
 
+bool SSources::SUnifyUnit::commitFiles(const std::string& ext, std::vector<std::string>& files, const std::string& group) {
+    if (files.size() == 1) {
+        ++sources->_stats.singleFiles;
+        LOG_I("Commit:single:%s\n", files[0].c_str());
+        sources->_files.push_back(files[0]);
+    } else {
+        Stats& stats = sources->_stats;
+        stats.unifiedFiles += (uint32_t)files.size();
+        stats.minUnifyFiles = (stats.minUnifyFiles == 0 || files.size() < stats.minUnifyFiles) ? (uint32_t)files.size() : stats.minUnifyFiles;
+        stats.maxUnifyFiles = stats.maxUnifyFiles < files.size() ? (uint32_t)files.size() : stats.maxUnifyFiles;
+        if (!sources->_deferUnified) {
+            sources->ensureUnifiedDir();
+        }
+        std::sort(files.begin(), files.end(), stricasecmp);
+        std::string unifiedPath;
+        int retry = 0;
+        do {
+            unifiedPath = sources->_unified_Path;
+            unifiedPath.append(getClearFileName(unifiedRoot.c_str()));
+            unifiedPath.append(ext);
+            if (retry) {
+                char buf[64];
+                sprintf(buf, "_%d", retry);
+                unifiedPath.append(buf);
+            }
+            unifiedPath.push_back('.');
+            unifiedPath.append(ext);
+            ++retry;
+        } while (contains(sources->_files, unifiedPath));
+        std::ostringstream os;
+        for (auto fi = files.begin(); fi != files.end(); ++fi) {
+            os << "#include \"" << sources->_unified_RelativeRoot << *fi << "\"\n";
+        }
+        if (sources->_deferUnified) {
+            sources->_unifiedContents.push_back({unifiedPath, os.str()});
+        } else if (!saveContentWithCheck(shared::Path(sources->_root.c_str(), unifiedPath.c_str()).c_str(), os.str())) {
+            return false;
+        }
+        if (!group.empty()) {
+            sources->_unifiedGroups[unifiedPath] = group;
+        }
+        if (sources->_longestFirst) {
+            uint64_t cost = 0;
+            for (auto fi = files.begin(); fi != files.end(); ++fi) {
+                sources->_sizedInputs.push_back(shared::Path(sources->_root.c_str(), fi->c_str()).string());
+                cost += fileSize(sources->_sizedInputs.back().c_str());
+            }
+            sources->_costs[unifiedPath] = cost;
+        }
+        sources->_files.push_back(unifiedPath);
+        LOG_I("Commit:unified:%s\n", unifiedPath.c_str());
+    }
+
+    return true;
+}
+
+const std::string* SSources::group(const std::string& path) const {
+    auto unified = _unifiedGroups.find(path);
+    if (unified != _unifiedGroups.end()) {
+        return &unified->second;
+    }
+    if (_fileGroups) {
+        auto file = _fileGroups->find(path);
+        if (file != _fileGroups->end()) {
+            return &file->second;
+        }
+    }
+    return NULL;
+}
+
 void SSources::printStats() {
-    printf("================= Stats ================\n");
-    printf("Scaned:: %d\n", _stats.scanDirs + _stats.scanFiles);
-    printf("  Dirs: %d\n", _stats.scanDirs);
-    printf("  Files: %d\n", _stats.scanFiles);
+    ELogLevel::Print(stdout, "================= Stats ================\n");
+    ELogLevel::Print(stdout, "Scaned:: %d\n", _stats.scanDirs + _stats.scanFiles);
+    ELogLevel::Print(stdout, "  Dirs: %d\n", _stats.scanDirs);
+    ELogLevel::Print(stdout, "  Files: %d\n", _stats.scanFiles);
     if (_stats.scanErrors) {
-        printf("  Errors: %d\n", _stats.scanErrors);
+        ELogLevel::Print(stdout, "  Errors: %d\n", _stats.scanErrors);
     }
     if (_stats.excludes()) {
-        printf("Excludes: %d\n", _stats.excludes());
+        ELogLevel::Print(stdout, "Excludes: %d\n", _stats.excludes());
     }
     if (_stats.excludeDirs) {
-        printf("  Dirs: %d\n", _stats.excludeDirs);
+        ELogLevel::Print(stdout, "  Dirs: %d\n", _stats.excludeDirs);
     }
     if (_stats.excludeFiles) {
-        printf("  Files: %d\n", _stats.excludeFiles);
+        ELogLevel::Print(stdout, "  Files: %d\n", _stats.excludeFiles);
     }
     if (_stats.skips()) {
-        printf("Skip: %d\n", _stats.skips());
+        ELogLevel::Print(stdout, "Skip: %d\n", _stats.skips());
     }
     if (_stats.skipFilesNoExt) {
-        printf("  Without ext: %d\n", _stats.skipFilesNoExt);
+        ELogLevel::Print(stdout, "  Without ext: %d\n", _stats.skipFilesNoExt);
     }
     if (_stats.skipFilesByExt) {
-        printf("  Ext filter: %d\n", _stats.skipFilesByExt);
+        ELogLevel::Print(stdout, "  Ext filter: %d\n", _stats.skipFilesByExt);
     }
     if (_stats.skipFilesByFileLists) {
-        printf("  Filelists filter: %d\n", _stats.skipFilesByFileLists);
-    }
-    printf("Files: %d -> %d\n", _stats.singleFiles + _stats.unifiedFiles, (int)_files.size());
-    printf("  Single: %d\n", _stats.singleFiles);
-    printf("  Unified: %d\n", _stats.unifiedFiles);
-    printf("    Unify min: %d\n", _stats.minUnifyFiles);
-    printf("    Unify max: %d\n", _stats.maxUnifyFiles);
-    printf("========================================\n");
+        ELogLevel::Print(stdout, "  Filelists filter: %d\n", _stats.skipFilesByFileLists);
+    }
+    ELogLevel::Print(stdout, "Files: %d -> %d\n", _stats.singleFiles + _stats.unifiedFiles, (int)(_files.size() + _mergedFiles));
+    ELogLevel::Print(stdout, "  Single: %d\n", _stats.singleFiles);
+    ELogLevel::Print(stdout, "  Unified: %d\n", _stats.unifiedFiles);
+    ELogLevel::Print(stdout, "    Unify min: %d\n", _stats.minUnifyFiles);
+    ELogLevel::Print(stdout, "    Unify max: %d\n", _stats.maxUnifyFiles);
+    ELogLevel::Print(stdout, "========================================\n");
+}
+
+void SSources::mergeStats(const SSources& other) {
+    const Stats& o = other._stats;
+    _stats.scanDirs += o.scanDirs;
+    _stats.scanFiles += o.scanFiles;
+    _stats.scanErrors += o.scanErrors;
+    _stats.excludeDirs += o.excludeDirs;
+    _stats.excludeFiles += o.excludeFiles;
+    _stats.skipFilesNoExt += o.skipFilesNoExt;
+    _stats.skipFilesByExt += o.skipFilesByExt;
+    _stats.skipFilesByFileLists += o.skipFilesByFileLists;
+    _stats.singleFiles += o.singleFiles;
+    _stats.unifiedFiles += o.unifiedFiles;
+    if (o.minUnifyFiles && (!_stats.minUnifyFiles || o.minUnifyFiles < _stats.minUnifyFiles)) {
+        _stats.minUnifyFiles = o.minUnifyFiles;
+    }
+    if (o.maxUnifyFiles > _stats.maxUnifyFiles) {
+        _stats.maxUnifyFiles = o.maxUnifyFiles;
+    }
+    _mergedFiles += other._files.size() + other._mergedFiles;
 }
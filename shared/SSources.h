@@ -26,6 +26,21 @@
 #include <map>
 #include <set>
 #include <istream>
+#include <mutex>
+#include <stdio.h>
+
+// version of the tools, stamps of other versions are not used
+#define CPP_BUILD_UNIFIER_VERSION "v2022.0914"
+
+// output of a thread kept to be printed at once after the thread is done,
+// see ELogLevel::SetThreadBuffer()
+struct LogBuffer {
+    std::string out;
+    std::string err;
+
+    // prints and clears the output
+    void flush();
+};
 
 struct ELogLevel {
     enum Enum {
@@ -46,6 +61,15 @@ struct ELogLevel {
     }
     static Enum FromString(const char* str);
 
+    // fprintf to stream, stdout or stderr, or to the buffer of the calling thread
+    static void Print(FILE* stream, const char* format, ...)
+#if defined(__GNUC__)
+        __attribute__((format(printf, 2, 3)))
+#endif
+        ;
+    // output of the calling thread goes to buffer until it is set to NULL
+    static void SetThreadBuffer(LogBuffer* buffer);
+
     static bool ParseLogLevel(const char* arg) {
         bool ok = false;
         Enum level = NONE;
@@ -72,14 +96,38 @@ private:
     static Enum g_logLevel;
 };
 
-#define LOG_E(...) if (ELogLevel::GetLogLevel() >= ELogLevel::ERROR) { fprintf(stderr, "Error: " __VA_ARGS__); }
+#define LOG_E(...) if (ELogLevel::GetLogLevel() >= ELogLevel::ERROR) { ELogLevel::Print(stderr, "Error: " __VA_ARGS__); }
 #define LOG_E_ONLY(x) if (ELogLevel::GetLogLevel() >= ELogLevel::ERROR) { (x); }
-#define LOG_W(...) if (ELogLevel::GetLogLevel() >= ELogLevel::WARNING) { printf("Warning: " __VA_ARGS__); }
+#define LOG_W(...) if (ELogLevel::GetLogLevel() >= ELogLevel::WARNING) { ELogLevel::Print(stdout, "Warning: " __VA_ARGS__); }
 #define LOG_W_ONLY(x) if (ELogLevel::GetLogLevel() >= ELogLevel::WARNING) { (x); }
-#define LOG_I(...) if (ELogLevel::GetLogLevel() >= ELogLevel::INFO) { printf(__VA_ARGS__); }
-#define LOG_D(...) if (ELogLevel::GetLogLevel() >= ELogLevel::LDEBUG) { printf(__VA_ARGS__); }
-#define LOG_T(...) if (ELogLevel::GetLogLevel() >= ELogLevel::LTRACE) { printf(__VA_ARGS__); }
-#define LOG_V(...) if (ELogLevel::GetLogLevel() >= ELogLevel::VERBOSE) { printf(__VA_ARGS__); }
+#define LOG_I(...) if (ELogLevel::GetLogLevel() >= ELogLevel::INFO) { ELogLevel::Print(stdout, __VA_ARGS__); }
+#define LOG_D(...) if (ELogLevel::GetLogLevel() >= ELogLevel::LDEBUG) { ELogLevel::Print(stdout, __VA_ARGS__); }
+#define LOG_T(...) if (ELogLevel::GetLogLevel() >= ELogLevel::LTRACE) { ELogLevel::Print(stdout, __VA_ARGS__); }
+#define LOG_V(...) if (ELogLevel::GetLogLevel() >= ELogLevel::VERBOSE) { ELogLevel::Print(stdout, __VA_ARGS__); }
+
+// entries of dirs, read once and shared by the sources scanning the same
+// trees, safe to use from several threads
+class SDirCache {
+public:
+    struct Entry {
+        std::string name;
+        bool dir;
+        bool file;
+        // stat failed
+        bool error;
+    };
+
+    // reads path, false when it can not be opened, errors are logged
+    static bool Read(const std::string& path, std::vector<Entry>& entries);
+
+    // the entries of path read once, false when it can not be opened
+    bool list(const std::string& path, const std::vector<Entry>*& entries);
+
+private:
+    std::mutex _mutex;
+    // map<dir, pair<opened, entries>>
+    std::map<std::string, std::pair<bool, std::vector<Entry>>> _dirs;
+};
 
 struct SSources {
 protected:
@@ -93,6 +141,23 @@ protected:
     const std::set<std::string> *_allFiles;
     bool _unified;
     bool _forceUnify;
+    // keep unified files in _unifiedContents instead of writing them
+    bool _deferUnified;
+    std::vector<std::pair<std::string, std::string>> _unifiedContents;
+    // map<file, group>, files are only unified with the ones of the same group
+    const std::map<std::string, std::string>* _fileGroups;
+    // map<unified file, group> of the groups not empty
+    std::map<std::string, std::string> _unifiedGroups;
+    // list files and dirs read by load(), missing ones included
+    std::vector<std::string> _inputs;
+    // order _files by estimated compile cost, see SortByCost()
+    bool _longestFirst;
+    // map<file, size or sizes of the sources of a unified file>, made when _longestFirst
+    std::map<std::string, uint64_t> _costs;
+    // sources the costs are made of
+    std::vector<std::string> _sizedInputs;
+    // shared dir entries, NULL reads dirs every time
+    SDirCache* _dirCache;
 
     std::string _unified_Path;
     std::string _unified_RelativeRoot;
@@ -124,14 +189,46 @@ protected:
     };
 
     Stats _stats;
+    // files of the sources merged by mergeStats()
+    size_t _mergedFiles;
 
 public:
-    SSources() : _unified(true), _unified_Path("@unified_build"), _unified_RelativeRoot("../"), _allFiles(NULL) {
+    SSources() : _unified(true), _unified_Path("@unified_build"), _unified_RelativeRoot("../"), _allFiles(NULL), _deferUnified(false), _fileGroups(NULL), _longestFirst(false), _dirCache(NULL), _mergedFiles(0) {
         memset(&_stats, 0, sizeof(Stats));
     }
     void setUnified(bool unified) {
         _unified = unified;
     }
+    // the caller writes the unified files, see unifiedContents()
+    void setDeferUnified(bool defer) {
+        _deferUnified = defer;
+    }
+    // path and content of the unified files not written
+    const std::vector<std::pair<std::string, std::string>>& unifiedContents() const {
+        return _unifiedContents;
+    }
+    void setFileGroups(const std::map<std::string, std::string>* groups) {
+        _fileGroups = groups;
+    }
+    void setDirCache(SDirCache* dirCache) {
+        _dirCache = dirCache;
+    }
+    void setLongestFirst(bool longestFirst) {
+        _longestFirst = longestFirst;
+    }
+    // orders files by descending cost, a file without one costs its size,
+    // equal costs by name so the order is stable
+    static void SortByCost(const std::string& root, std::vector<std::string>& files, const std::map<std::string, uint64_t>& costs);
+    // list files and dirs the sources are made of, see FileStamp
+    const std::vector<std::string>& inputs() const {
+        return _inputs;
+    }
+    // sources only the sizes of are read, see setLongestFirst()
+    const std::vector<std::string>& sizedInputs() const {
+        return _sizedInputs;
+    }
+    // group of a source or unified file, NULL when none
+    const std::string* group(const std::string& path) const;
     bool load(const char* root, const char* src_list);
     bool mergelist(const char* list, const std::string& relative = "");
 
@@ -146,6 +243,8 @@ public:
     void ensureUnifiedDir();
 
     void printStats();
+    // adds the stats of other, printStats() prints the sum
+    void mergeStats(const SSources& other);
 
 private:
     bool load(std::istream& is_list, std::string path_prefix);
@@ -157,6 +256,7 @@ private:
         
         bool add(const char* file);
         bool commit();
+        bool commitFiles(const std::string& ext, std::vector<std::string>& files, const std::string& group);
     };
 
     bool addDir(SUnifyUnit& bu, const std::string& path, bool recursive);
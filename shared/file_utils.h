@@ -26,7 +26,28 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
 #include <shared/utils/StrBuf.h>
+#if defined(__APPLE__)
+#include <mach-o/dyld.h>
+#endif
+
+// 64-bit FNV-1a of data
+inline uint64_t HashData(const void* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
 inline bool loadContent(const char* name, std::string& data) {
     FILE* f = fopen(name, "rb");
@@ -95,6 +116,231 @@ inline bool saveContentWithCheck(const char* name, const shared::StrBuf& data) {
     return saveContent(name, data);
 }
 
+// Private mapping of a whole file, pages are read in lazily. A writable
+// mapping is copy on write and is followed by a 0 so it can be parsed in
+// place, changes are never written back to the file.
+class MappedFile {
+public:
+    MappedFile() : _data(NULL), _size(0), _mapSize(0), _writable(false) {
+    }
+    ~MappedFile() {
+        close();
+    }
+
+    // false for a missing or empty file
+    bool open(const char* name, bool writable = false) {
+        close();
+        int fd = ::open(name, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            const size_t size = (size_t)info.st_size;
+            if (writable) {
+                // zero filled pages with the file mapped over the start, the
+                // terminating 0 is there even when size is a multiple of a page
+                const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+                const size_t mapSize = (size + 1 + page - 1) / page * page;
+                void* area = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+                if (area != MAP_FAILED) {
+                    void* data = mmap(area, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+                    if (data != MAP_FAILED) {
+                        _data = (char*)data;
+                        _mapSize = mapSize;
+                    } else {
+                        munmap(area, mapSize);
+                    }
+                }
+            } else {
+                void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    _data = (char*)data;
+                    _mapSize = size;
+                }
+            }
+            if (_data) {
+                _size = size;
+                _writable = writable;
+                madvise(_data, _size, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+        return _data != NULL;
+    }
+
+    void close() {
+        if (_data) {
+            munmap(_data, _mapSize);
+            _data = NULL;
+            _size = 0;
+            _mapSize = 0;
+            _writable = false;
+        }
+    }
+
+    const char* data() const {
+        return _data;
+    }
+    // NULL unless opened writable
+    char* writableData() const {
+        return _writable ? _data : NULL;
+    }
+    size_t size() const {
+        return _size;
+    }
+
+private:
+    char* _data;
+    size_t _size;
+    size_t _mapSize;
+    bool _writable;
+
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+};
+
+// Writes a file through a fixed size buffer. Content is compared with the old
+// file as it is written, nothing is written until the first different byte,
+// from there name.tmp is written and replaces name on close.
+class FileWriterWithCheck {
+public:
+    static const size_t kBufferSize = 64 * 1024;
+
+    explicit FileWriterWithCheck(const char* name) : _name(name), _old((const char*)MAP_FAILED), _oldSize(0), _mode(0644), _offset(0), _file(NULL), _failed(false) {
+        // the file a link points to is replaced, not the link
+        struct stat link;
+        if (lstat(name, &link) == 0 && S_ISLNK(link.st_mode)) {
+            char* real = realpath(name, NULL);
+            if (real) {
+                _name = real;
+                free(real);
+            }
+        }
+        bool mapped = false;
+        int fd = open(_name.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            struct stat info;
+            if (fstat(fd, &info) == 0) {
+                _mode = info.st_mode & 07777;
+                _oldSize = (size_t)info.st_size;
+                if (_oldSize) {
+                    _old = (const char*)mmap(NULL, _oldSize, PROT_READ, MAP_PRIVATE, fd, 0);
+                    mapped = _old != MAP_FAILED;
+                } else {
+                    mapped = true;
+                }
+            }
+            ::close(fd);
+        }
+        if (!mapped) {
+            // no old file to compare with, write all
+            _oldSize = 0;
+            diverge();
+        }
+    }
+
+    ~FileWriterWithCheck() {
+        if (_file) {
+            fclose(_file);
+            unlink(tempName().c_str());
+        }
+        unmap();
+    }
+
+    void write(const char* data, size_t length) {
+        if (!_file && !_failed) {
+            size_t same = 0;
+            if (_offset < _oldSize) {
+                const size_t count = std::min(length, _oldSize - _offset);
+                if (memcmp(_old + _offset, data, count) == 0) {
+                    same = count;
+                } else {
+                    while (same < count && _old[_offset + same] == data[same]) {
+                        ++same;
+                    }
+                }
+            }
+            _offset += same;
+            if (same == length) {
+                return;
+            }
+            data += same;
+            length -= same;
+            diverge();
+        }
+        if (_file && fwrite(data, 1, length, _file) != length) {
+            _failed = true;
+        }
+        _offset += length;
+    }
+
+    // writes and clears buf when it is full
+    void flush(shared::StrBuf& buf, bool force = false) {
+        if (force || buf.length() >= kBufferSize) {
+            write(buf.data(), buf.length());
+            buf.clear();
+        }
+    }
+
+    bool close() {
+        if (!_file && !_failed && _offset != _oldSize) {
+            // same as the beginning of old file
+            diverge();
+        }
+        unmap();
+        if (!_file) {
+            return !_failed;
+        }
+        bool ok = fclose(_file) == 0 && !_failed;
+        _file = NULL;
+        const std::string temp = tempName();
+        if (ok) {
+            ok = rename(temp.c_str(), _name.c_str()) == 0;
+        }
+        if (!ok) {
+            unlink(temp.c_str());
+        }
+        return ok;
+    }
+
+private:
+    std::string tempName() const {
+        return _name + ".tmp";
+    }
+
+    void diverge() {
+        _file = fopen(tempName().c_str(), "wb");
+        if (!_file) {
+            _failed = true;
+            return;
+        }
+        // keep the mode of the old file
+        fchmod(fileno(_file), _mode);
+        if (_offset && fwrite(_old, 1, _offset, _file) != _offset) {
+            _failed = true;
+        }
+    }
+
+    void unmap() {
+        if (_old != MAP_FAILED) {
+            munmap((void*)_old, _oldSize);
+            _old = (const char*)MAP_FAILED;
+        }
+    }
+
+    std::string _name;
+    const char* _old;
+    size_t _oldSize;
+    mode_t _mode;
+    size_t _offset;
+    FILE* _file;
+    bool _failed;
+
+    FileWriterWithCheck(const FileWriterWithCheck& other) = delete;
+    FileWriterWithCheck& operator=(const FileWriterWithCheck& other) = delete;
+};
+
 inline bool isDir(const char* path) {
     struct stat info;
     if (stat(path, &info) < 0) {
@@ -140,4 +386,174 @@ inline void CreateDirs(const std::string& path, const std::string& fileName) {
     }
 }
 
+// Records the mtime, size and hash of the inputs and outputs of a run, a
+// later run with the same header finding them unchanged can be skipped
+// after a stat of each. A file with another mtime but the same size and
+// hash is unchanged, dirs have the mtime only, missing files stay missing,
+// files added by addSize() have the size only. Stamps made by another build
+// of the tool are not used.
+class FileStamp {
+public:
+    // stamps of another format are not used
+    enum { Format_Version = 1 };
+
+    // header holds the tool version and the options changing the outputs
+    explicit FileStamp(const std::string& header) : _header("stamp " + std::to_string((int)Format_Version) + " build=" + buildIdentity() + " " + header) {
+    }
+
+    void add(const std::string& path) {
+        _paths.insert(path);
+    }
+
+    template <typename Iter>
+    void add(Iter begin, Iter end) {
+        _paths.insert(begin, end);
+    }
+
+    // only a change of the size of path counts
+    template <typename Iter>
+    void addSize(Iter begin, Iter end) {
+        _sizePaths.insert(begin, end);
+    }
+
+    bool save(const char* name) const {
+        shared::StrBuf content;
+        content.appendf("%s\n", _header.c_str());
+        for (auto iter = _paths.begin(); iter != _paths.end(); ++iter) {
+            struct stat info;
+            if (stat(iter->c_str(), &info) < 0) {
+                content.appendf("- 0.0 0 0 %s\n", iter->c_str());
+                continue;
+            }
+            const bool dir = S_ISDIR(info.st_mode);
+            long long sec;
+            long nsec;
+            mtime(info, sec, nsec);
+            content.appendf("%c %lld.%09ld %llu %016llx %s\n", dir ? 'd' : 'f', sec, nsec,
+                            dir ? 0ULL : (unsigned long long)info.st_size,
+                            dir ? 0ULL : (unsigned long long)hash(iter->c_str()), iter->c_str());
+        }
+        for (auto iter = _sizePaths.begin(); iter != _sizePaths.end(); ++iter) {
+            struct stat info;
+            if (_paths.find(*iter) != _paths.end()) {
+                continue;
+            }
+            if (stat(iter->c_str(), &info) < 0) {
+                content.appendf("- 0.0 0 0 %s\n", iter->c_str());
+            } else {
+                content.appendf("s 0.0 %llu 0 %s\n", (unsigned long long)info.st_size, iter->c_str());
+            }
+        }
+        return saveContentWithCheck(name, content);
+    }
+
+    // true when the stamp has the same header and none of its files changed
+    bool unchanged(const char* name) const {
+        std::string content;
+        if (!loadContent(name, content)) {
+            return false;
+        }
+        const size_t headerEnd = content.find('\n');
+        if (headerEnd == std::string::npos || content.compare(0, headerEnd, _header) != 0) {
+            return false;
+        }
+        size_t pos = headerEnd + 1;
+        if (pos >= content.length()) {
+            return false;
+        }
+        while (pos < content.length()) {
+            size_t end = content.find('\n', pos);
+            if (end == std::string::npos) {
+                return false;
+            }
+            std::string line = content.substr(pos, end - pos);
+            pos = end + 1;
+            char type = 0;
+            long long sec = 0;
+            long nsec = 0;
+            unsigned long long size = 0, fileHash = 0;
+            int pathPos = 0;
+            if (sscanf(line.c_str(), "%c %lld.%ld %llu %llx %n", &type, &sec, &nsec, &size, &fileHash, &pathPos) != 5 || !pathPos) {
+                return false;
+            }
+            const char* path = line.c_str() + pathPos;
+            struct stat info;
+            if (stat(path, &info) < 0) {
+                if (type != '-') {
+                    return false;
+                }
+                continue;
+            }
+            if (type == '-' || (type == 'd') != S_ISDIR(info.st_mode)) {
+                return false;
+            }
+            if (type == 's') {
+                if ((unsigned long long)info.st_size != size) {
+                    return false;
+                }
+                continue;
+            }
+            long long curSec;
+            long curNsec;
+            mtime(info, curSec, curNsec);
+            if (curSec == sec && curNsec == nsec && (type == 'd' || (unsigned long long)info.st_size == size)) {
+                continue;
+            }
+            if (type == 'd' || (unsigned long long)info.st_size != size || hash(path) != fileHash) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    static void mtime(const struct stat& info, long long& sec, long& nsec) {
+#if defined(__APPLE__)
+        sec = info.st_mtimespec.tv_sec;
+        nsec = info.st_mtimespec.tv_nsec;
+#else
+        sec = info.st_mtim.tv_sec;
+        nsec = info.st_mtim.tv_nsec;
+#endif
+    }
+
+    // size and mtime of the running binary, the build time when it is not found
+    static const std::string& buildIdentity() {
+        static const std::string identity = [] {
+            char path[4096];
+            bool found = false;
+#if defined(__APPLE__)
+            uint32_t size = sizeof(path);
+            found = _NSGetExecutablePath(path, &size) == 0;
+#else
+            const ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+            if (length > 0) {
+                path[length] = 0;
+                found = true;
+            }
+#endif
+            struct stat info;
+            if (!found || stat(path, &info) < 0) {
+                return std::string(__DATE__ "-" __TIME__);
+            }
+            long long sec;
+            long nsec;
+            mtime(info, sec, nsec);
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%llu-%lld.%09ld", (unsigned long long)info.st_size, sec, nsec);
+            return std::string(buf);
+        }();
+        return identity;
+    }
+
+    static uint64_t hash(const char* name) {
+        MappedFile file;
+        return file.open(name) ? HashData(file.data(), file.size()) : HashData(NULL, 0);
+    }
+
+    std::string _header;
+    std::set<std::string> _paths;
+    std::set<std::string> _sizePaths;
+};
+
 #endif//__shared_file_utils_h__
@@ -0,0 +1,72 @@
+// Copyright (c) 2018-2021 bianchui https://github.com/bianchui
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef shared_utils_ParallelFor_h__
+#define shared_utils_ParallelFor_h__
+#include <stddef.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+namespace shared {
+
+// jobs == 0 means one job per hardware thread
+inline size_t ParallelJobs(size_t jobs, size_t count) {
+    if (!jobs) {
+        jobs = std::thread::hardware_concurrency();
+    }
+    if (jobs > count) {
+        jobs = count;
+    }
+    return jobs ? jobs : 1;
+}
+
+// call func(index) for index in [0, count) on up to jobs threads,
+// the calling thread works too, returns when all are done.
+template <typename Func>
+void ParallelFor(size_t count, size_t jobs, const Func& func) {
+    jobs = ParallelJobs(jobs, count);
+    if (jobs <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            func(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < count) {
+            func(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(jobs - 1);
+    for (size_t i = 1; i < jobs; ++i) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto iter = threads.begin(); iter != threads.end(); ++iter) {
+        iter->join();
+    }
+}
+
+}
+
+#endif//shared_utils_ParallelFor_h__
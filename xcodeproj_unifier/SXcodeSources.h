@@ -25,6 +25,10 @@
 struct SXcodeSources : SSources {
     static constexpr const char* Unified_Path = "@unified_targets";
     static constexpr const char* Unified_RelativeRoot = "../../";
+    // group and dir of unified files identical in several targets
+    static constexpr const char* Common_Name = "@common";
+    // name prefix of the static library targets holding sources shared by targets
+    static constexpr const char* Shared_Prefix = "unified_shared_";
 
 public:
     SXcodeSources() {
@@ -21,37 +21,60 @@
 #include "UnifiedXcodeProject.hpp"
 #include "xcodeproj/namehash.h"
 #include <shared/utils/StrBuf.h>
+#include <shared/SharedMacros.h>
+#include <algorithm>
 #include "SXcodeSources.h"
 
-std::string UnifiedXcodeProject::KeyForGroupOrFile(const char* path, const char* name) {
+pbxproj::SId UnifiedXcodeProject::IdForGroupOrFile(const char* path, const char* name) {
     pbxproj::SId id;
     id._id[0] = 0;
     id._id[1] = HashPath(path, 131);
     id._id[2] = HashPath(name, 131);
-    char sid[32];
-    id.toString(sid);
-    shared::StrBuf buf;
-    buf.printf("%s /* %s */", sid, name);
-    return buf.string();
+    return id;
 }
 
-std::string UnifiedXcodeProject::KeyForBuildFile(const char* path, const char* file, const char* target) {
+pbxproj::SId UnifiedXcodeProject::IdForBuildFile(const char* path, const char* file, const char* target) {
     pbxproj::SId id;
     id._id[0] = HashPath(target, 131);
     id._id[1] = HashPath(path, 131);
     id._id[2] = HashPath(file, 131);
+    return id;
+}
+
+static std::string keyString(const pbxproj::SId& id, const char* comment) {
     char sid[32];
     id.toString(sid);
     shared::StrBuf buf;
-    buf.printf("%s /* %s in Sources */", sid, file);
+    buf.printf("%s /* %s */", sid, comment);
     return buf.string();
 }
 
+std::string UnifiedXcodeProject::newKey(pbxproj::SId id, const char* comment, pbxproj::SId_set* pending) const {
+    // ids are stable hashes of paths, on collision step the first word so
+    // the same project always gets the same ids
+    while (_objectmap.find(id) != _objectmap.end() || (pending && pending->find(id) != pending->end())) {
+        LOG_W("Id %s of %s is in use\n", id.toString().c_str(), comment);
+        ++id._id[0];
+    }
+    if (pending) {
+        pending->insert(id);
+    }
+    return keyString(id, comment);
+}
+
+std::string UnifiedXcodeProject::newKey(pbxproj::SId id, const char* comment, Edit& edit) {
+    while (!edit.takeId(id)) {
+        LOG_W("Id %s of %s is in use\n", id.toString().c_str(), comment);
+        ++id._id[0];
+    }
+    return keyString(id, comment);
+}
+
 NeXTSTEP::Object* UnifiedXcodeProject::targetGetUnifiedRoot(const char* target) {
     if (!valid()) {
         return NULL;
     }
-    NeXTSTEP::Object* mainGroup = _objects->objectByKey(_project->stringByKey("mainGroup"));
+    NeXTSTEP::Object* mainGroup = object(_project->stringByKey("mainGroup"));
     if (!mainGroup) {
         return NULL;
     }
@@ -62,6 +85,21 @@ NeXTSTEP::Object* UnifiedXcodeProject::targetGetUnifiedRoot(const char* target)
     return getOrNewChildGroup(unified_root, target);
 }
 
+NeXTSTEP::Object* UnifiedXcodeProject::targetFindUnifiedRoot(const char* target) const {
+    if (!valid()) {
+        return NULL;
+    }
+    NeXTSTEP::Object* mainGroup = object(_project->stringByKey("mainGroup"));
+    const pbxproj::PBXPath* path = mainGroup ? findGroupOrFilePath(mainGroup) : NULL;
+    if (path) {
+        path = findChildGroupOrFilePath(path, pbxproj::PBXPath::escape(SXcodeSources::Unified_Path).c_str(), false);
+    }
+    if (path) {
+        path = findChildGroupOrFilePath(path, pbxproj::PBXPath::escape(target).c_str(), false);
+    }
+    return path ? const_cast<NeXTSTEP::Object*>(path->obj) : NULL;
+}
+
 void UnifiedXcodeProject::getAllFiles(std::set<std::string>& files) {
     for (auto iter = _pathmap.begin(); iter != _pathmap.end(); ++iter) {
         const auto& info = iter->second;
@@ -73,42 +111,50 @@ void UnifiedXcodeProject::getAllFiles(std::set<std::string>& files) {
     }
 }
 
-NeXTSTEP::Array* UnifiedXcodeProject::targetGetBuildFiles(NeXTSTEP::Object* target) {
+NeXTSTEP::Object* UnifiedXcodeProject::targetGetSourcesBuildPhase(NeXTSTEP::Object* target) {
     auto buildPhases = target->arrayByKey("buildPhases");
     if (!buildPhases) {
         return NULL;
     }
     for (auto iter = buildPhases->begin(); iter != buildPhases->end(); ++iter) {
-        pbxproj::ProjectItem phase(_objects->objectByKey(iter->string()));
-        if (phase.isa("PBXSourcesBuildPhase")) {
-            return phase->arrayByKey("files");
+        pbxproj::ProjectItem phase(object(iter->string()));
+        if (phase.isa(pbxproj::IsaType::PBXSourcesBuildPhase)) {
+            return phase;
         }
     }
     return NULL;
 }
 
-NeXTSTEP::Object* UnifiedXcodeProject::getOrNewChildGroupOrFile(NeXTSTEP::Object* parent, const char* name_, bool file) {
+NeXTSTEP::Array* UnifiedXcodeProject::targetGetBuildFiles(NeXTSTEP::Object* target) {
+    NeXTSTEP::Object* phase = targetGetSourcesBuildPhase(target);
+    return phase ? phase->arrayByKey("files") : NULL;
+}
+
+NeXTSTEP::Object* UnifiedXcodeProject::getOrNewChildGroupOrFile(NeXTSTEP::Object* parent, const char* name, bool file) {
+    Edit edit(*this);
+    const std::string key = getOrNewChildGroupOrFile(edit, parent, name, file);
+    if (key.empty() || !edit.commit()) {
+        return NULL;
+    }
+    return object(key.c_str());
+}
+
+std::string UnifiedXcodeProject::getOrNewChildGroupOrFile(Edit& edit, NeXTSTEP::Object* parent, const char* name_, bool file) {
     const char* isa = file ? "PBXFileReference" : "PBXGroup";
     assert(parent);
-    NeXTSTEP::Array* parentChildren = parent->arrayByKey("children");
+    std::vector<std::string>* parentChildren = edit.values(parent, "children");
     if (!parentChildren) {
-        return NULL;
+        return std::string();
     }
     std::string name = pbxproj::PBXPath::escape(name_);
-    for (auto iter = parentChildren->begin(); iter != parentChildren->end(); ++iter) {
-        pbxproj::ProjectItem obj(_objects->objectByKey(iter->string()));
-        if (!obj.isa(isa)) {
-            continue;
-        }
-        auto path = obj->stringByKey("path");
-        if (path && strcasecmp(path, name.c_str()) == 0) {
-            return obj;
-        }
-    }
     const pbxproj::PBXPath* parentPath = findGroupOrFilePath(parent);
     assert(parentPath);
     if (!parentPath) {
-        return NULL;
+        return std::string();
+    }
+    const pbxproj::PBXPath* childPath = findChildGroupOrFilePath(parentPath, name.c_str(), file);
+    if (childPath && !edit.removing(childPath->key)) {
+        return childPath->key;
     }
 
     NeXTSTEP::Object* obj = new NeXTSTEP::Object();
@@ -122,40 +168,728 @@ NeXTSTEP::Object* UnifiedXcodeProject::getOrNewChildGroupOrFile(NeXTSTEP::Object
     obj->set("path", name.c_str());
     obj->set("sourceTree", pbxproj::SourceTreeType::ToString(pbxproj::SourceTreeType::Group));
 
-    std::string key = KeyForGroupOrFile(parentPath->pathFromSourceTree.c_str(), name_);
+    std::string key = newKey(IdForGroupOrFile(parentPath->pathFromSourceTree.c_str(), name_), name_, edit);
 
     {
         const char* comp_key = strchr(key.c_str(), '/');
         if (!comp_key) {
             comp_key = key.c_str();
         }
-        bool added = false;
-        for (auto iter = parentChildren->begin(); iter != parentChildren->end(); ++iter) {
-            if (!iter->isString()) {
-                continue;
-            }
-            const char* str = iter->string();
+        auto iter = parentChildren->begin();
+        for (; iter != parentChildren->end(); ++iter) {
+            const char* str = iter->c_str();
             const char* comp_str = strchr(str, '/');
             if (!comp_str) {
                 comp_str = str;
             }
             if (strcasecmp(comp_str, comp_key) >= 0) {
-                parentChildren->insert(iter, NeXTSTEP::Value::NewString(key.c_str()));
-                added = true;
                 break;
             }
         }
-        if (!added) {
-            parentChildren->push_back(NeXTSTEP::Value::NewString(key.c_str()));
+        // a removed child with the same id is still listed
+        if (iter == parentChildren->end() || *iter != key) {
+            parentChildren->insert(iter, key);
+        }
+    }
+
+    edit.add(new NeXTSTEP::KeyValue(key.c_str(), obj), parentPath, file);
+    return key;
+}
+
+pbxproj::SId UnifiedXcodeProject::IdForSharedLib(const char* lib, const char* kind, const char* name) {
+    pbxproj::SId id;
+    id._id[0] = HashPath(lib, 131);
+    id._id[1] = HashPath(kind, 131);
+    id._id[2] = HashPath(name, 131);
+    return id;
+}
+
+static std::vector<std::string> arrayStrings(const NeXTSTEP::Array* array) {
+    std::vector<std::string> strings;
+    if (array) {
+        for (auto iter = array->begin(); iter != array->end(); ++iter) {
+            if (iter->isString()) {
+                strings.push_back(iter->string());
+            }
+        }
+    }
+    return strings;
+}
+
+static const char* unquoted(const std::string& key, std::string& buffer) {
+    if (key.length() >= 2 && key[0] == '"' && key.back() == '"') {
+        buffer = key.substr(1, key.length() - 2);
+        return buffer.c_str();
+    }
+    return key.c_str();
+}
+
+// build settings of the product itself and of its packaging, all the others
+// can change how a source is compiled or how a library links into its consumers
+static bool isProductSetting(const std::string& key) {
+    static const char* kNames[] = {
+        "PRODUCT_NAME", "PRODUCT_BUNDLE_IDENTIFIER", "PRODUCT_BUNDLE_PACKAGE_TYPE", "PRODUCT_MODULE_NAME",
+        "SKIP_INSTALL", "INSTALL_PATH", "WRAPPER_EXTENSION", "EXECUTABLE_PREFIX", "EXECUTABLE_EXTENSION",
+        "MACH_O_TYPE", "GENERATE_INFOPLIST_FILE", "MARKETING_VERSION", "CURRENT_PROJECT_VERSION",
+        "VERSIONING_SYSTEM", "DEVELOPMENT_TEAM", "DEVELOPMENT_ASSET_PATHS", "ENABLE_PREVIEWS",
+        "TARGETED_DEVICE_FAMILY", "TEST_HOST", "TEST_TARGET_NAME", "BUNDLE_LOADER", "DEFINES_MODULE",
+        "ALWAYS_EMBED_SWIFT_STANDARD_LIBRARIES", "COPY_PHASE_STRIP", "OTHER_LDFLAGS", "UNIFIED_SHARED_LDFLAGS",
+        "LIBRARY_SEARCH_PATHS", "EXCLUDED_SOURCE_FILE_NAMES", "UNIFIED_EXCLUDED_SOURCE_FILE_NAMES",
+    };
+    static const char* kPrefixes[] = {
+        "INFOPLIST_", "CODE_SIGN_", "PROVISIONING_PROFILE", "ASSETCATALOG_", "LD_", "DYLIB_", "STRIP_",
+    };
+    std::string buffer;
+    const char* name = unquoted(key, buffer);
+    for (size_t i = 0; i < _countof(kNames); ++i) {
+        if (strcmp(name, kNames[i]) == 0) {
+            return true;
+        }
+    }
+    for (size_t i = 0; i < _countof(kPrefixes); ++i) {
+        if (strncmp(name, kPrefixes[i], strlen(kPrefixes[i])) == 0) {
+            return true;
+        }
+    }
+    // settings of a configuration are matched by name, "KEY[sdk=...]" too
+    const char* bracket = strchr(name, '[');
+    return bracket && isProductSetting(std::string(name, bracket - name));
+}
+
+// keeps the keys sorted like Xcode does
+static void setSorted(NeXTSTEP::Object* obj, const char* key, NeXTSTEP::Value&& value) {
+    obj->remove(key);
+    std::string buffer;
+    auto iter = obj->begin();
+    while (iter != obj->end() && strcmp(unquoted((*iter)->key, buffer), key) < 0) {
+        ++iter;
+    }
+    obj->insert(iter, new NeXTSTEP::KeyValue(key, std::move(value)));
+}
+
+NeXTSTEP::Object* UnifiedXcodeProject::targetByName(const char* name) {
+    if (!valid()) {
+        return NULL;
+    }
+    const std::string escaped = pbxproj::PBXPath::escape(name);
+    NeXTSTEP::Array* targets = _project->arrayByKey("targets");
+    if (targets) {
+        for (auto iter = targets->begin(); iter != targets->end(); ++iter) {
+            NeXTSTEP::Object* target = iter->isString() ? object(iter->string()) : NULL;
+            const char* targetName = target ? target->stringByKey("name") : NULL;
+            if (targetName && escaped.compare(targetName) == 0) {
+                return target;
+            }
+        }
+    }
+    return NULL;
+}
+
+const char* UnifiedXcodeProject::targetKey(NeXTSTEP::Object* target) {
+    NeXTSTEP::Array* targets = valid() ? _project->arrayByKey("targets") : NULL;
+    if (targets) {
+        for (auto iter = targets->begin(); iter != targets->end(); ++iter) {
+            if (iter->isString() && object(iter->string()) == target) {
+                return iter->string();
+            }
+        }
+    }
+    return NULL;
+}
+
+std::string UnifiedXcodeProject::targetCompileSignature(NeXTSTEP::Object* target) {
+    shared::StrBuf buf;
+    NeXTSTEP::Object* list = object(target->stringByKey("buildConfigurationList"));
+    NeXTSTEP::Array* configs = list ? list->arrayByKey("buildConfigurations") : NULL;
+    if (configs) {
+        for (auto iter = configs->begin(); iter != configs->end(); ++iter) {
+            NeXTSTEP::Object* config = iter->isString() ? object(iter->string()) : NULL;
+            if (!config) {
+                continue;
+            }
+            const char* name = config->stringByKey("name");
+            const char* base = config->stringByKey("baseConfigurationReference");
+            buf.appendf("%s:%s\n", name ? name : "", base ? base : "");
+            NeXTSTEP::Object* settings = config->objectByKey("buildSettings");
+            if (settings) {
+                for (auto i2 = settings->begin(); i2 != settings->end(); ++i2) {
+                    if (!isProductSetting((*i2)->key)) {
+                        buf.appendf("%s = ", (*i2)->key.c_str());
+                        (*i2)->value.write(-1, buf);
+                        buf.append('\n');
+                    }
+                }
+            }
+        }
+    }
+    return buf.string();
+}
+
+NeXTSTEP::Object* UnifiedXcodeProject::getOrNewStaticLibTarget(const char* name, NeXTSTEP::Object* like) {
+    NeXTSTEP::Object* lib = targetByName(name);
+    if (lib || !like) {
+        return lib;
+    }
+    NeXTSTEP::Object* likeList = object(like->stringByKey("buildConfigurationList"));
+    NeXTSTEP::Array* likeConfigs = likeList ? likeList->arrayByKey("buildConfigurations") : NULL;
+    if (!likeConfigs) {
+        return NULL;
+    }
+    const pbxproj::IsaType::Enum kSections[] = {
+        pbxproj::IsaType::PBXFileReference,
+        pbxproj::IsaType::PBXNativeTarget,
+        pbxproj::IsaType::PBXSourcesBuildPhase,
+        pbxproj::IsaType::XCBuildConfiguration,
+        pbxproj::IsaType::XCConfigurationList,
+    };
+    for (size_t i = 0; i < _countof(kSections); ++i) {
+        if (!ensureSection(kSections[i])) {
+            return NULL;
         }
     }
 
-    NeXTSTEP::KeyValue* kv = new NeXTSTEP::KeyValue(key.c_str(), obj);
-    _pathmap.insert({kv->key.c_str(), pbxproj::PBXPath(obj, kv->key.c_str(), parentPath, file)});
-    addItem(kv);
+    Edit edit(*this);
+    pbxproj::SId_set ids;
+    const std::string escapedName = pbxproj::PBXPath::escape(name);
 
-    assert(_objects->objectByKey(key.c_str()));
+    const std::string productFile = std::string("lib") + name + ".a";
+    const std::string productKey = newKey(IdForSharedLib(name, "product", productFile.c_str()), productFile.c_str(), &ids);
+    {
+        NeXTSTEP::Object* product = new NeXTSTEP::Object();
+        product->set("isa", "PBXFileReference");
+        product->set("explicitFileType", "archive.ar");
+        product->set("includeInIndex", "0");
+        product->set("path", pbxproj::PBXPath::escape(productFile).c_str());
+        product->set("sourceTree", pbxproj::SourceTreeType::ToString(pbxproj::SourceTreeType::Products));
+        edit.add(new NeXTSTEP::KeyValue(productKey.c_str(), product));
+    }
 
-    return obj;
+    NeXTSTEP::Array* configKeys = new NeXTSTEP::Array();
+    for (auto iter = likeConfigs->begin(); iter != likeConfigs->end(); ++iter) {
+        NeXTSTEP::Object* likeConfig = iter->isString() ? object(iter->string()) : NULL;
+        const char* configName = likeConfig ? likeConfig->stringByKey("name") : NULL;
+        if (!configName) {
+            continue;
+        }
+        // settings of like but the product ones, sorted by name as xcode writes them
+        std::vector<NeXTSTEP::KeyValue*> items;
+        NeXTSTEP::Object* likeSettings = likeConfig->objectByKey("buildSettings");
+        if (likeSettings) {
+            for (auto i2 = likeSettings->begin(); i2 != likeSettings->end(); ++i2) {
+                if (!isProductSetting((*i2)->key)) {
+                    items.push_back(new NeXTSTEP::KeyValue((*i2)->key.c_str(), NeXTSTEP::Value::NewCopy((*i2)->value)));
+                }
+            }
+        }
+        items.push_back(new NeXTSTEP::KeyValue("PRODUCT_NAME", NeXTSTEP::Value::NewString("\"$(TARGET_NAME)\"")));
+        items.push_back(new NeXTSTEP::KeyValue("SKIP_INSTALL", NeXTSTEP::Value::NewString("YES")));
+        std::stable_sort(items.begin(), items.end(), [](const NeXTSTEP::KeyValue* a, const NeXTSTEP::KeyValue* b) {
+            std::string bufferA, bufferB;
+            return strcmp(unquoted(a->key, bufferA), unquoted(b->key, bufferB)) < 0;
+        });
+        NeXTSTEP::Object* settings = new NeXTSTEP::Object();
+        settings->assign(items.begin(), items.end());
+
+        NeXTSTEP::Object* config = new NeXTSTEP::Object();
+        config->set("isa", "XCBuildConfiguration");
+        const char* base = likeConfig->stringByKey("baseConfigurationReference");
+        if (base) {
+            config->set("baseConfigurationReference", base);
+        }
+        config->set("buildSettings", settings);
+        config->set("name", configName);
+        const std::string configKey = newKey(IdForSharedLib(name, "config", configName), configName, &ids);
+        configKeys->push_back(NeXTSTEP::Value::NewString(configKey.c_str()));
+        edit.add(new NeXTSTEP::KeyValue(configKey.c_str(), config));
+    }
 
+    const std::string listComment = "Build configuration list for PBXNativeTarget " + (escapedName[0] == '"' ? escapedName : "\"" + escapedName + "\"");
+    const std::string listKey = newKey(IdForSharedLib(name, "configs", name), listComment.c_str(), &ids);
+    {
+        NeXTSTEP::Object* list = new NeXTSTEP::Object();
+        list->set("isa", "XCConfigurationList");
+        list->set("buildConfigurations", configKeys);
+        const char* visible = likeList->stringByKey("defaultConfigurationIsVisible");
+        list->set("defaultConfigurationIsVisible", visible ? visible : "0");
+        const char* defaultName = likeList->stringByKey("defaultConfigurationName");
+        if (defaultName) {
+            list->set("defaultConfigurationName", defaultName);
+        }
+        edit.add(new NeXTSTEP::KeyValue(listKey.c_str(), list));
+    }
+
+    const std::string sourcesKey = newKey(IdForSharedLib(name, "sources", name), "Sources", &ids);
+    {
+        NeXTSTEP::Object* sources = new NeXTSTEP::Object();
+        sources->set("isa", "PBXSourcesBuildPhase");
+        sources->set("buildActionMask", "2147483647");
+        sources->set("files", new NeXTSTEP::Array());
+        sources->set("runOnlyForDeploymentPostprocessing", "0");
+        edit.add(new NeXTSTEP::KeyValue(sourcesKey.c_str(), sources));
+    }
+
+    const std::string targetKey = newKey(IdForSharedLib(name, "target", name), name, &ids);
+    {
+        NeXTSTEP::Object* target = new NeXTSTEP::Object();
+        target->set("isa", "PBXNativeTarget");
+        target->set("buildConfigurationList", listKey.c_str());
+        NeXTSTEP::Array* phases = new NeXTSTEP::Array();
+        phases->push_back(NeXTSTEP::Value::NewString(sourcesKey.c_str()));
+        target->set("buildPhases", phases);
+        target->set("buildRules", new NeXTSTEP::Array());
+        target->set("dependencies", new NeXTSTEP::Array());
+        target->set("name", escapedName.c_str());
+        target->set("productName", escapedName.c_str());
+        target->set("productReference", productKey.c_str());
+        target->set("productType", "\"com.apple.product-type.library.static\"");
+        edit.add(new NeXTSTEP::KeyValue(targetKey.c_str(), target));
+    }
+
+    NeXTSTEP::Object* productGroup = object(_project->stringByKey("productRefGroup"));
+    if (productGroup && productGroup->arrayByKey("children")) {
+        std::vector<std::string> children = arrayStrings(productGroup->arrayByKey("children"));
+        children.push_back(productKey);
+        edit.rewrite(productGroup, "children", std::move(children));
+    }
+    std::vector<std::string> targets = arrayStrings(_project->arrayByKey("targets"));
+    targets.push_back(targetKey);
+    edit.rewrite(_project, "targets", std::move(targets));
+
+    // attributes of like but the test host, keyed by the bare id as xcode does
+    NeXTSTEP::Object* projectAttributes = _project->objectByKey("attributes");
+    NeXTSTEP::Object* targetAttributes = projectAttributes ? projectAttributes->objectByKey("TargetAttributes") : NULL;
+    if (targetAttributes) {
+        NeXTSTEP::Object* attributes = new NeXTSTEP::Object();
+        const char* likeKey = this->targetKey(like);
+        NeXTSTEP::Object* likeAttributes = likeKey ? targetAttributes->objectByKey(std::string(likeKey).substr(0, 24).c_str()) : NULL;
+        if (likeAttributes) {
+            for (auto iter = likeAttributes->begin(); iter != likeAttributes->end(); ++iter) {
+                if ((*iter)->key.compare("TestTargetID") != 0) {
+                    attributes->push_back(new NeXTSTEP::KeyValue((*iter)->key.c_str(), NeXTSTEP::Value::NewCopy((*iter)->value)));
+                }
+            }
+        }
+        edit.set(_project, targetAttributes, targetKey.substr(0, 24).c_str(), attributes);
+    }
+    if (!edit.commit()) {
+        return NULL;
+    }
+    return object(targetKey.c_str());
+}
+
+bool UnifiedXcodeProject::targetDependsOn(NeXTSTEP::Object* target, NeXTSTEP::Object* other) {
+    const char* otherKey = targetKey(other);
+    NeXTSTEP::Array* dependencies = target->arrayByKey("dependencies");
+    if (!otherKey || !dependencies) {
+        return false;
+    }
+    const pbxproj::ObjectKey other_ = otherKey;
+    for (auto iter = dependencies->begin(); iter != dependencies->end(); ++iter) {
+        NeXTSTEP::Object* dependency = iter->isString() ? object(iter->string()) : NULL;
+        const char* dependencyTarget = dependency ? dependency->stringByKey("target") : NULL;
+        if (dependencyTarget && pbxproj::ObjectKey(dependencyTarget) == other_) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// sets key of settings to values, none removes it, and refers to it by reference
+// from the list setting, which gets initial first when it is made, false when
+// both were already so
+static bool setReferredSetting(NeXTSTEP::Object* settings, const char* key, const std::vector<std::string>& values,
+                               const char* list, const char* reference, const char* initial) {
+    const NeXTSTEP::Value* current = settings->valueByKey(key);
+    const bool valuesSynced = !current ? values.empty() : (current->isArray() && arrayStrings(current->array()) == values);
+
+    // the other items of the list are kept
+    const NeXTSTEP::Value* value = settings->valueByKey(list);
+    std::vector<std::string> items;
+    if (value && value->isString()) {
+        items.push_back(value->string());
+    } else if (value && value->isArray()) {
+        items = arrayStrings(value->array());
+    }
+    auto found = std::find(items.begin(), items.end(), reference);
+    const bool referenceSynced = values.empty() == (found == items.end());
+    if (valuesSynced && referenceSynced) {
+        return false;
+    }
+    if (!valuesSynced) {
+        if (values.empty()) {
+            settings->remove(key);
+        } else {
+            NeXTSTEP::Array* array = new NeXTSTEP::Array();
+            for (auto iter = values.begin(); iter != values.end(); ++iter) {
+                array->push_back(NeXTSTEP::Value::NewString(iter->c_str()));
+            }
+            setSorted(settings, key, NeXTSTEP::Value::NewArray(array));
+        }
+    }
+    if (referenceSynced) {
+        return true;
+    }
+    if (values.empty()) {
+        items.erase(found);
+        if (initial && items.size() == 1 && items[0] == initial) {
+            items.clear();
+        }
+    } else {
+        if (!value && initial) {
+            items.push_back(initial);
+        }
+        items.push_back(reference);
+    }
+    if (items.empty()) {
+        settings->remove(list);
+    } else if (items.size() == 1 && (values.empty() || !value || value->isString())) {
+        setSorted(settings, list, NeXTSTEP::Value::NewString(items[0].c_str()));
+    } else {
+        NeXTSTEP::Array* array = new NeXTSTEP::Array();
+        for (auto iter = items.begin(); iter != items.end(); ++iter) {
+            array->push_back(NeXTSTEP::Value::NewString(iter->c_str()));
+        }
+        setSorted(settings, list, NeXTSTEP::Value::NewArray(array));
+    }
+    return true;
+}
+
+bool UnifiedXcodeProject::targetSetUnifiedExcludes(NeXTSTEP::Object* target, const std::vector<std::string>& perFileConfigs,
+                                                   const std::vector<std::string>& unifiedFiles, const std::vector<std::string>& perFileSources) {
+    NeXTSTEP::Object* list = object(target->stringByKey("buildConfigurationList"));
+    NeXTSTEP::Array* configs = list ? list->arrayByKey("buildConfigurations") : NULL;
+    if (!configs) {
+        return false;
+    }
+    const bool clear = unifiedFiles.empty() && perFileSources.empty();
+    for (auto iter = configs->begin(); iter != configs->end(); ++iter) {
+        NeXTSTEP::Object* config = iter->isString() ? object(iter->string()) : NULL;
+        NeXTSTEP::Object* settings = config ? config->objectByKey("buildSettings") : NULL;
+        const char* name = config ? config->stringByKey("name") : NULL;
+        if (!settings || !name) {
+            return false;
+        }
+        std::string buffer;
+        const bool perFile = std::find(perFileConfigs.begin(), perFileConfigs.end(), unquoted(name, buffer)) != perFileConfigs.end();
+        std::vector<std::string> excludes;
+        if (!clear) {
+            const std::vector<std::string>& files = perFile ? unifiedFiles : perFileSources;
+            for (auto file = files.begin(); file != files.end(); ++file) {
+                excludes.push_back(pbxproj::PBXPath::escape(*file));
+            }
+        }
+        if (setReferredSetting(settings, "UNIFIED_EXCLUDED_SOURCE_FILE_NAMES", excludes,
+                               "EXCLUDED_SOURCE_FILE_NAMES", "\"$(UNIFIED_EXCLUDED_SOURCE_FILE_NAMES)\"", NULL)) {
+            touch(config);
+        }
+    }
+    return true;
+}
+
+bool UnifiedXcodeProject::targetSetSharedLdflags(NeXTSTEP::Object* target, NeXTSTEP::Object* lib) {
+    NeXTSTEP::Object* list = object(target->stringByKey("buildConfigurationList"));
+    NeXTSTEP::Array* configs = list ? list->arrayByKey("buildConfigurations") : NULL;
+    if (!configs) {
+        return false;
+    }
+    std::vector<std::string> flags;
+    if (lib) {
+        NeXTSTEP::Object* product = object(lib->stringByKey("productReference"));
+        const char* path = product ? product->stringByKey("path") : NULL;
+        if (!path) {
+            return false;
+        }
+        flags.push_back(pbxproj::PBXPath::escape("-force_load"));
+        flags.push_back(pbxproj::PBXPath::escape("$(BUILT_PRODUCTS_DIR)/" + pbxproj::PBXPath::unescape(path)));
+    }
+    for (auto iter = configs->begin(); iter != configs->end(); ++iter) {
+        NeXTSTEP::Object* config = iter->isString() ? object(iter->string()) : NULL;
+        NeXTSTEP::Object* settings = config ? config->objectByKey("buildSettings") : NULL;
+        if (!settings) {
+            return false;
+        }
+        if (setReferredSetting(settings, "UNIFIED_SHARED_LDFLAGS", flags,
+                               "OTHER_LDFLAGS", "\"$(UNIFIED_SHARED_LDFLAGS)\"", "\"$(inherited)\"")) {
+            touch(config);
+        }
+    }
+    return true;
+}
+
+bool UnifiedXcodeProject::targetLinkLibrary(NeXTSTEP::Object* target, NeXTSTEP::Object* lib) {
+    const char* libKey = targetKey(lib);
+    const char* productKey = lib->stringByKey("productReference");
+    const char* targetName = target->stringByKey("name");
+    const char* libName = lib->stringByKey("name");
+    NeXTSTEP::Array* dependencies = target->arrayByKey("dependencies");
+    NeXTSTEP::Array* buildPhases = target->arrayByKey("buildPhases");
+    if (!libKey || !productKey || !targetName || !libName || !dependencies || !buildPhases) {
+        return false;
+    }
+    const pbxproj::ObjectKey lib_ = libKey;
+    const pbxproj::ObjectKey product_ = productKey;
+
+    const bool depends = targetDependsOn(target, lib);
+    NeXTSTEP::Object* frameworks = NULL;
+    for (auto iter = buildPhases->begin(); iter != buildPhases->end() && !frameworks; ++iter) {
+        pbxproj::ProjectItem phase(iter->isString() ? object(iter->string()) : NULL);
+        if (phase.isa(pbxproj::IsaType::PBXFrameworksBuildPhase)) {
+            frameworks = phase;
+        }
+    }
+    bool links = false;
+    NeXTSTEP::Array* frameworkFiles = frameworks ? frameworks->arrayByKey("files") : NULL;
+    if (frameworkFiles) {
+        for (auto iter = frameworkFiles->begin(); iter != frameworkFiles->end() && !links; ++iter) {
+            NeXTSTEP::Object* buildFile = iter->isString() ? object(iter->string()) : NULL;
+            const char* fileRef = buildFile ? buildFile->stringByKey("fileRef") : NULL;
+            links = fileRef && pbxproj::ObjectKey(fileRef) == product_;
+        }
+    }
+    if (depends && links) {
+        return true;
+    }
+    const pbxproj::IsaType::Enum kSections[] = {
+        pbxproj::IsaType::PBXBuildFile,
+        pbxproj::IsaType::PBXContainerItemProxy,
+        pbxproj::IsaType::PBXFrameworksBuildPhase,
+        pbxproj::IsaType::PBXTargetDependency,
+    };
+    for (size_t i = 0; i < _countof(kSections); ++i) {
+        if (!ensureSection(kSections[i])) {
+            return false;
+        }
+    }
+
+    Edit edit(*this);
+    pbxproj::SId_set ids;
+    if (!depends) {
+        const char* rootKey = _plist.stringByKey("rootObject");
+        if (!rootKey) {
+            return false;
+        }
+        const std::string proxyKey = newKey(IdForSharedLib(libName, "proxy", targetName), "PBXContainerItemProxy", &ids);
+        NeXTSTEP::Object* proxy = new NeXTSTEP::Object();
+        proxy->set("isa", "PBXContainerItemProxy");
+        proxy->set("containerPortal", rootKey);
+        proxy->set("proxyType", "1");
+        proxy->set("remoteGlobalIDString", lib_.isId ? lib_.id.toString().c_str() : libKey);
+        proxy->set("remoteInfo", libName);
+        edit.add(new NeXTSTEP::KeyValue(proxyKey.c_str(), proxy));
+
+        const std::string dependencyKey = newKey(IdForSharedLib(libName, "dependency", targetName), "PBXTargetDependency", &ids);
+        NeXTSTEP::Object* dependency = new NeXTSTEP::Object();
+        dependency->set("isa", "PBXTargetDependency");
+        dependency->set("target", libKey);
+        dependency->set("targetProxy", proxyKey.c_str());
+        edit.add(new NeXTSTEP::KeyValue(dependencyKey.c_str(), dependency));
+
+        std::vector<std::string> values = arrayStrings(dependencies);
+        values.push_back(dependencyKey);
+        edit.rewrite(target, "dependencies", std::move(values));
+    }
+    if (!links) {
+        const char* productPath = object(productKey) ? object(productKey)->stringByKey("path") : NULL;
+        std::string comment = std::string(productPath ? productPath : libName) + " in Frameworks";
+        const std::string buildKey = newKey(IdForSharedLib(libName, "link", targetName), comment.c_str(), &ids);
+        NeXTSTEP::Object* buildFile = new NeXTSTEP::Object();
+        buildFile->set("isa", "PBXBuildFile");
+        buildFile->set("fileRef", productKey);
+        edit.add(new NeXTSTEP::KeyValue(buildKey.c_str(), buildFile));
+        if (frameworkFiles) {
+            std::vector<std::string> values = arrayStrings(frameworkFiles);
+            values.push_back(buildKey);
+            edit.rewrite(frameworks, "files", std::move(values));
+        } else {
+            const std::string phaseKey = newKey(IdForSharedLib(libName, "frameworks", targetName), "Frameworks", &ids);
+            NeXTSTEP::Object* phase = new NeXTSTEP::Object();
+            phase->set("isa", "PBXFrameworksBuildPhase");
+            phase->set("buildActionMask", "2147483647");
+            NeXTSTEP::Array* files = new NeXTSTEP::Array();
+            files->push_back(NeXTSTEP::Value::NewString(buildKey.c_str()));
+            phase->set("files", files);
+            phase->set("runOnlyForDeploymentPostprocessing", "0");
+            edit.add(new NeXTSTEP::KeyValue(phaseKey.c_str(), phase));
+            std::vector<std::string> values = arrayStrings(buildPhases);
+            values.push_back(phaseKey);
+            edit.rewrite(target, "buildPhases", std::move(values));
+        }
+    }
+    return edit.commit();
+}
+
+bool UnifiedXcodeProject::removeStaticLibTarget(NeXTSTEP::Object* lib) {
+    const char* libKey = targetKey(lib);
+    const char* libName = lib->stringByKey("name");
+    const char* productKey = lib->stringByKey("productReference");
+    NeXTSTEP::Array* targets = _project->arrayByKey("targets");
+    if (!libKey || !libName || !targets) {
+        return false;
+    }
+    const pbxproj::ObjectKey lib_ = libKey;
+    const pbxproj::ObjectKey product_ = productKey ? productKey : "";
+    std::vector<NeXTSTEP::Object*> consumers;
+
+    Edit edit(*this);
+    std::vector<std::string> targetKeys;
+    for (auto iter = targets->begin(); iter != targets->end(); ++iter) {
+        NeXTSTEP::Object* target = iter->isString() ? object(iter->string()) : NULL;
+        if (target == lib) {
+            continue;
+        }
+        targetKeys.push_back(iter->string());
+        const char* targetName = target ? target->stringByKey("name") : NULL;
+        if (!targetName) {
+            continue;
+        }
+        bool linked = false;
+        NeXTSTEP::Array* dependencies = target->arrayByKey("dependencies");
+        if (dependencies) {
+            std::vector<std::string> kept;
+            for (auto i2 = dependencies->begin(); i2 != dependencies->end(); ++i2) {
+                NeXTSTEP::Object* dependency = i2->isString() ? object(i2->string()) : NULL;
+                const char* dependencyTarget = dependency ? dependency->stringByKey("target") : NULL;
+                if (dependencyTarget && pbxproj::ObjectKey(dependencyTarget) == lib_) {
+                    edit.remove(i2->string());
+                    edit.remove(dependency->stringByKey("targetProxy"));
+                    linked = true;
+                } else if (i2->isString()) {
+                    kept.push_back(i2->string());
+                }
+            }
+            if (linked) {
+                edit.rewrite(target, "dependencies", std::move(kept));
+            }
+        }
+        NeXTSTEP::Array* buildPhases = target->arrayByKey("buildPhases");
+        if (!buildPhases || !productKey) {
+            if (linked) {
+                consumers.push_back(target);
+            }
+            continue;
+        }
+        // a frameworks phase made to link lib goes with it
+        const pbxproj::ObjectKey madePhase = IdForSharedLib(libName, "frameworks", targetName);
+        std::vector<std::string> phases;
+        for (auto i2 = buildPhases->begin(); i2 != buildPhases->end(); ++i2) {
+            pbxproj::ProjectItem phase(i2->isString() ? object(i2->string()) : NULL);
+            NeXTSTEP::Array* files = phase.isa(pbxproj::IsaType::PBXFrameworksBuildPhase) ? phase->arrayByKey("files") : NULL;
+            std::vector<std::string> kept;
+            bool removed = false;
+            if (files) {
+                for (auto i3 = files->begin(); i3 != files->end(); ++i3) {
+                    NeXTSTEP::Object* buildFile = i3->isString() ? object(i3->string()) : NULL;
+                    const char* fileRef = buildFile ? buildFile->stringByKey("fileRef") : NULL;
+                    if (fileRef && pbxproj::ObjectKey(fileRef) == product_) {
+                        edit.remove(i3->string());
+                        removed = true;
+                    } else if (i3->isString()) {
+                        kept.push_back(i3->string());
+                    }
+                }
+            }
+            if (removed && kept.empty() && pbxproj::ObjectKey(i2->string()) == madePhase) {
+                edit.remove(i2->string());
+                continue;
+            }
+            if (removed) {
+                edit.rewrite(phase, "files", std::move(kept));
+                linked = true;
+            }
+            if (i2->isString()) {
+                phases.push_back(i2->string());
+            }
+        }
+        if (phases.size() != buildPhases->size()) {
+            edit.rewrite(target, "buildPhases", std::move(phases));
+            linked = true;
+        }
+        if (linked) {
+            consumers.push_back(target);
+        }
+    }
+
+    NeXTSTEP::Array* libPhases = lib->arrayByKey("buildPhases");
+    if (libPhases) {
+        for (auto iter = libPhases->begin(); iter != libPhases->end(); ++iter) {
+            NeXTSTEP::Object* phase = iter->isString() ? object(iter->string()) : NULL;
+            NeXTSTEP::Array* files = phase ? phase->arrayByKey("files") : NULL;
+            if (files) {
+                for (auto i2 = files->begin(); i2 != files->end(); ++i2) {
+                    if (i2->isString()) {
+                        edit.remove(i2->string());
+                    }
+                }
+            }
+            if (iter->isString()) {
+                edit.remove(iter->string());
+            }
+        }
+    }
+    const char* listKey = lib->stringByKey("buildConfigurationList");
+    NeXTSTEP::Object* list = object(listKey);
+    NeXTSTEP::Array* configs = list ? list->arrayByKey("buildConfigurations") : NULL;
+    if (configs) {
+        for (auto iter = configs->begin(); iter != configs->end(); ++iter) {
+            if (iter->isString()) {
+                edit.remove(iter->string());
+            }
+        }
+    }
+    edit.remove(listKey);
+    if (productKey) {
+        edit.remove(productKey);
+        NeXTSTEP::Object* productGroup = object(_project->stringByKey("productRefGroup"));
+        NeXTSTEP::Array* children = productGroup ? productGroup->arrayByKey("children") : NULL;
+        if (children) {
+            std::vector<std::string> kept;
+            for (auto iter = children->begin(); iter != children->end(); ++iter) {
+                if (iter->isString() && !(pbxproj::ObjectKey(iter->string()) == product_)) {
+                    kept.push_back(iter->string());
+                }
+            }
+            edit.rewrite(productGroup, "children", std::move(kept));
+        }
+    }
+    edit.remove(libKey);
+    edit.rewrite(_project, "targets", std::move(targetKeys));
+
+    NeXTSTEP::Object* projectAttributes = _project->objectByKey("attributes");
+    NeXTSTEP::Object* targetAttributes = projectAttributes ? projectAttributes->objectByKey("TargetAttributes") : NULL;
+    const std::string libId = lib_.isId ? lib_.id.toString() : std::string();
+    if (targetAttributes && !libId.empty() && targetAttributes->valueByKey(libId.c_str())) {
+        edit.set(_project, targetAttributes, libId.c_str(), NULL);
+    }
+
+    // unified group of lib with the files in it
+    NeXTSTEP::Object* group = targetFindUnifiedRoot(pbxproj::PBXPath::unescape(libName).c_str());
+    const pbxproj::PBXPath* groupPath = group ? findGroupOrFilePath(group) : NULL;
+    if (groupPath) {
+        NeXTSTEP::Array* children = group->arrayByKey("children");
+        if (children) {
+            for (auto iter = children->begin(); iter != children->end(); ++iter) {
+                if (iter->isString()) {
+                    edit.remove(iter->string());
+                }
+            }
+        }
+        NeXTSTEP::Object* root = object(groupPath->parentKey);
+        std::vector<std::string>* rootChildren = root ? edit.values(root, "children") : NULL;
+        if (rootChildren) {
+            const pbxproj::ObjectKey group_ = groupPath->key;
+            rootChildren->erase(std::remove_if(rootChildren->begin(), rootChildren->end(), [&](const std::string& key) {
+                return pbxproj::ObjectKey(key.c_str()) == group_;
+            }), rootChildren->end());
+        }
+        edit.remove(groupPath->key);
+    }
+    if (!edit.commit()) {
+        return false;
+    }
+    for (auto iter = consumers.begin(); iter != consumers.end(); ++iter) {
+        if (!targetSetSharedLdflags(*iter, NULL)) {
+            return false;
+        }
+    }
+    return true;
 }
@@ -28,18 +28,57 @@ public:
     void getAllFiles(std::set<std::string>& files);
 
     NeXTSTEP::Object* targetGetUnifiedRoot(const char* target);
+    // NULL when not made yet
+    NeXTSTEP::Object* targetFindUnifiedRoot(const char* target) const;
+    NeXTSTEP::Object* targetGetSourcesBuildPhase(NeXTSTEP::Object* target);
     NeXTSTEP::Array* targetGetBuildFiles(NeXTSTEP::Object* target);
 
     NeXTSTEP::Object* getOrNewChildGroupOrFile(NeXTSTEP::Object* parent, const char* name, bool file);
+    // key of the child group or file name of parent, a new one is staged in
+    // edit with the children of parent, empty on failure
+    std::string getOrNewChildGroupOrFile(Edit& edit, NeXTSTEP::Object* parent, const char* name, bool file);
     NeXTSTEP::Object* getOrNewChildGroup(NeXTSTEP::Object* parent, const char* name) {
         return getOrNewChildGroupOrFile(parent, name, false);
     }
     NeXTSTEP::Object* getOrNewChildFile(NeXTSTEP::Object* parent, const char* name) {
         return getOrNewChildGroupOrFile(parent, name, true);
     }
+    std::string getOrNewChildFile(Edit& edit, NeXTSTEP::Object* parent, const char* name) {
+        return getOrNewChildGroupOrFile(edit, parent, name, true);
+    }
+
+    NeXTSTEP::Object* targetByName(const char* name);
+    // key of target in the project targets, NULL if it is not there
+    const char* targetKey(NeXTSTEP::Object* target);
+    // configuration names and build settings of target but the ones of its
+    // product, targets with the same signature compile a source file the same way
+    std::string targetCompileSignature(NeXTSTEP::Object* target);
+    // static library target with the configurations and the build settings of
+    // like but the ones of its product, created when missing
+    NeXTSTEP::Object* getOrNewStaticLibTarget(const char* name, NeXTSTEP::Object* like);
+    bool targetDependsOn(NeXTSTEP::Object* target, NeXTSTEP::Object* other);
+    // sets UNIFIED_EXCLUDED_SOURCE_FILE_NAMES of the configurations of target, to
+    // unifiedFiles in perFileConfigs and to perFileSources in the others, and
+    // refers it from EXCLUDED_SOURCE_FILE_NAMES, both empty remove it
+    bool targetSetUnifiedExcludes(NeXTSTEP::Object* target, const std::vector<std::string>& perFileConfigs,
+                                  const std::vector<std::string>& unifiedFiles, const std::vector<std::string>& perFileSources);
+    // target depends on lib and links its product, nothing is added twice
+    bool targetLinkLibrary(NeXTSTEP::Object* target, NeXTSTEP::Object* lib);
+    // removes the static library target lib made by getOrNewStaticLibTarget(),
+    // the links of other targets to it and its unified group
+    bool removeStaticLibTarget(NeXTSTEP::Object* lib);
+    // target loads all objects of the product of lib, by -force_load in
+    // UNIFIED_SHARED_LDFLAGS referred from OTHER_LDFLAGS, NULL lib removes it
+    bool targetSetSharedLdflags(NeXTSTEP::Object* target, NeXTSTEP::Object* lib);
 
-    static std::string KeyForGroupOrFile(const char* path, const char* name);
-    static std::string KeyForBuildFile(const char* path, const char* file, const char* target);
+    static pbxproj::SId IdForGroupOrFile(const char* path, const char* name);
+    static pbxproj::SId IdForBuildFile(const char* path, const char* file, const char* target);
+    static pbxproj::SId IdForSharedLib(const char* lib, const char* kind, const char* name);
+    // key of a new object, an id already used by an object or by one in
+    // pending is probed to the next free id, the id used is added to pending
+    std::string newKey(pbxproj::SId id, const char* comment, pbxproj::SId_set* pending = NULL) const;
+    // key of a new object added by edit, ids of objects it removes are free
+    static std::string newKey(pbxproj::SId id, const char* comment, Edit& edit);
 };
 
 #endif//UnifiedXcodeProject_hpp
@@ -22,9 +22,15 @@
 #include "shared/str_utils.h"
 #include "shared/file_utils.h"
 #include <shared/utils/Path.h>
+#include <shared/utils/ParallelFor.h>
 #include "SXcodeSources.h"
+#include "xcodeproj/namehash.h"
+#include <unordered_map>
+#include <sstream>
+#include <algorithm>
 
 void XcodeProjUnifier::printInfosToFile(std::string name) {
+    sortObjects();
     shared::StrBuf buf;
     if (false) {
         Impl::debugDump(buf);
@@ -48,18 +54,483 @@ void XcodeProjUnifier::printInfosToFile(std::string name) {
     }
 }
 
+// the sources a unified file includes
+static void unifiedSources(const std::string& content, std::vector<std::string>& sources) {
+    const std::string begin_include = std::string("#include \"") + SXcodeSources::Unified_RelativeRoot;
+    size_t pos = 0;
+    while ((pos = content.find(begin_include, pos)) != std::string::npos) {
+        pos += begin_include.length();
+        const size_t end = content.find('"', pos);
+        if (end == std::string::npos) {
+            break;
+        }
+        sources.push_back(content.substr(pos, end - pos));
+        pos = end;
+    }
+}
+
+// names of excluded files, the path when the name is not unique in files
+static std::vector<std::string> excludePatterns(const std::vector<std::string>& excluded, const std::vector<std::string>& files) {
+    std::map<std::string, int> names;
+    for (auto iter = files.begin(); iter != files.end(); ++iter) {
+        ++names[iter->substr(iter->rfind('/') + 1)];
+    }
+    std::vector<std::string> patterns;
+    for (auto iter = excluded.begin(); iter != excluded.end(); ++iter) {
+        std::string name = iter->substr(iter->rfind('/') + 1);
+        patterns.push_back(names[name] > 1 ? "*/" + *iter : name);
+    }
+    return patterns;
+}
+
+void XcodeProjUnifier::readSourceFlags(const char* proj_path, TargetSources& info) {
+    NeXTSTEP::Array* build_files = Impl::targetGetBuildFiles(info.target);
+    if (!build_files) {
+        return;
+    }
+    const std::string begin_unified = std::string(SXcodeSources::Unified_Path) + "/";
+    for (auto iter = build_files->begin(); iter != build_files->end(); ++iter) {
+        NeXTSTEP::Object* buildFile = iter->isString() ? object(iter->string()) : NULL;
+        NeXTSTEP::Object* settings = buildFile ? buildFile->objectByKey("settings") : NULL;
+        const char* flags = settings ? settings->stringByKey("COMPILER_FLAGS") : NULL;
+        NeXTSTEP::Object* fileRef = flags ? object(buildFile->stringByKey("fileRef")) : NULL;
+        const pbxproj::PBXPath* pathInfo = fileRef ? Impl::findGroupOrFilePath(fileRef) : NULL;
+        if (!pathInfo) {
+            continue;
+        }
+        const std::string& path = pathInfo->pathFromSourceTree;
+        if (!isBeginWith(path, begin_unified)) {
+            info.sourceFlags[path] = flags;
+            continue;
+        }
+        // the sources of a unified file are its includes
+        std::string content;
+        if (!loadContent(shared::Path(proj_path, path.c_str()).c_str(), content)) {
+            continue;
+        }
+        std::vector<std::string> sources;
+        unifiedSources(content, sources);
+        for (auto source = sources.begin(); source != sources.end(); ++source) {
+            info.sourceFlags[*source] = flags;
+        }
+    }
+}
+
+bool XcodeProjUnifier::writeUnifiedFiles(const char* proj_path, std::vector<TargetSources>& targets, std::map<std::string, const std::string*>& contents) {
+    // identical unified files of different targets, found by content hash in target order
+    struct Unit {
+        const std::string* content;
+        const std::string* path;
+        size_t lastTarget;
+        int users;
+        std::string commonPath;
+    };
+    std::vector<Unit> units;
+    std::unordered_multimap<size_t, size_t> unitsByHash;
+    std::vector<std::vector<size_t>> unitsOf(targets.size());
+    std::hash<std::string> hash;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        if (!targets[i].loaded) {
+            continue;
+        }
+        const auto& contents = targets[i].srcs.unifiedContents();
+        for (auto iter = contents.begin(); iter != contents.end(); ++iter) {
+            const size_t h = hash(iter->second);
+            size_t index = units.size();
+            for (auto range = unitsByHash.equal_range(h); range.first != range.second; ++range.first) {
+                const Unit& unit = units[range.first->second];
+                if (unit.lastTarget != i && *unit.content == iter->second) {
+                    index = range.first->second;
+                    break;
+                }
+            }
+            if (index == units.size()) {
+                units.push_back({&iter->second, &iter->first, i, 0, std::string()});
+                unitsByHash.insert({h, index});
+            }
+            units[index].lastTarget = i;
+            ++units[index].users;
+            unitsOf[i].push_back(index);
+        }
+    }
+
+    // one copy under the common dir, named by the first target's file
+    const std::string commonDir = std::string(SXcodeSources::Unified_Path) + "/" + SXcodeSources::Common_Name + "/";
+    std::set<std::string, bool(*)(const std::string&, const std::string&)> commonNames(stricasecmp);
+    std::vector<std::pair<const std::string*, const std::string*>> writes;
+    int common = 0;
+    for (auto unit = units.begin(); unit != units.end(); ++unit) {
+        if (unit->users < 2) {
+            writes.push_back({unit->path, unit->content});
+            continue;
+        }
+        const std::string file = unit->path->substr(unit->path->rfind('/') + 1);
+        const size_t dot = file.rfind('.');
+        std::string name = file;
+        for (int retry = 1; !commonNames.insert(name).second; ++retry) {
+            char buf[64];
+            sprintf(buf, "_%d", retry);
+            name = file.substr(0, dot) + buf + file.substr(dot);
+        }
+        unit->commonPath = commonDir + name;
+        writes.push_back({&unit->commonPath, unit->content});
+        ++common;
+    }
+    for (size_t i = 0; i < targets.size(); ++i) {
+        if (!targets[i].loaded) {
+            continue;
+        }
+        const auto& contents = targets[i].srcs.unifiedContents();
+        std::map<std::string, const std::string*> moved;
+        for (size_t j = 0; j < contents.size(); ++j) {
+            const Unit& unit = units[unitsOf[i][j]];
+            if (unit.users > 1) {
+                moved[contents[j].first] = &unit.commonPath;
+            }
+        }
+        if (moved.empty()) {
+            continue;
+        }
+        auto& info = targets[i];
+        for (auto iter = info.files.begin(); iter != info.files.end(); ++iter) {
+            auto found = moved.find(*iter);
+            if (found == moved.end()) {
+                continue;
+            }
+            auto flags = info.flags.find(*iter);
+            if (flags != info.flags.end()) {
+                info.flags[*found->second] = flags->second;
+                info.flags.erase(flags);
+            }
+            *iter = *found->second;
+        }
+    }
+    if (common) {
+        LOG_I("Common %d unified files in %s\n", common, commonDir.c_str());
+    }
+
+    std::string root = proj_path;
+    if (root.length() && root.back() != '/') {
+        root.push_back('/');
+    }
+    std::set<std::string> dirs;
+    for (auto iter = writes.begin(); iter != writes.end(); ++iter) {
+        contents[*iter->first] = iter->second;
+        if (dirs.insert(iter->first->substr(0, iter->first->rfind('/') + 1)).second) {
+            CreateDirs(root, *iter->first);
+        }
+    }
+    std::vector<char> results(writes.size(), 0);
+    shared::ParallelFor(writes.size(), _jobs, [&](size_t i) {
+        results[i] = saveContentWithCheck((root + *writes[i].first).c_str(), *writes[i].second);
+    });
+    return std::find(results.begin(), results.end(), 0) == results.end();
+}
+
+bool XcodeProjUnifier::removeUnusedCommonFiles(const std::vector<TargetSources>& targets) {
+    NeXTSTEP::Object* common_group = Impl::targetFindUnifiedRoot(SXcodeSources::Common_Name);
+    NeXTSTEP::Array* children = common_group ? common_group->arrayByKey("children") : NULL;
+    if (!children) {
+        return true;
+    }
+    // files of skipped targets are kept too
+    pbxproj::ObjectKey_set used;
+    for (auto iter = targets.begin(); iter != targets.end(); ++iter) {
+        NeXTSTEP::Array* build_files = Impl::targetGetBuildFiles(iter->target);
+        if (!build_files) {
+            continue;
+        }
+        for (auto file = build_files->begin(); file != build_files->end(); ++file) {
+            NeXTSTEP::Object* buildFile = file->isString() ? object(file->string()) : NULL;
+            const char* fileRef = buildFile ? buildFile->stringByKey("fileRef") : NULL;
+            if (fileRef) {
+                used.insert(fileRef);
+            }
+        }
+    }
+    Edit cleanup(*this);
+    std::vector<std::string> kept;
+    for (auto iter = children->begin(); iter != children->end(); ++iter) {
+        if (!iter->isString()) {
+            continue;
+        }
+        if (used.find(iter->string()) != used.end()) {
+            kept.push_back(iter->string());
+        } else {
+            cleanup.remove(iter->string());
+        }
+    }
+    if (kept.size() == children->size()) {
+        return true;
+    }
+    cleanup.rewrite(common_group, "children", std::move(kept));
+    return cleanup.commit();
+}
+
+bool XcodeProjUnifier::extractSharedLibs(std::vector<TargetSources>& targets) {
+    // targets that link, grouped by compile settings in target order
+    std::vector<std::pair<std::string, std::vector<size_t>>> groups;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        const auto& info = targets[i];
+        const char* productType = info.target->stringByKey("productType");
+        if (!info.loaded || !productType || strstr(productType, "library.static")) {
+            continue;
+        }
+        std::string signature = Impl::targetCompileSignature(info.target);
+        auto group = groups.begin();
+        while (group != groups.end() && group->first != signature) {
+            ++group;
+        }
+        if (group == groups.end()) {
+            groups.push_back({std::move(signature), std::vector<size_t>()});
+            group = groups.end() - 1;
+        }
+        group->second.push_back(i);
+    }
+
+    struct SharedLib {
+        NeXTSTEP::Object* target;
+        std::string name;
+        std::vector<std::string> files;
+        std::map<std::string, std::string> flags;
+    };
+    std::vector<SharedLib> libs;
+    for (auto group = groups.begin(); group != groups.end(); ++group) {
+        const std::vector<size_t>& members = group->second;
+        if (members.size() < 2) {
+            continue;
+        }
+        // identical unified files are already common, so a source is known by its path
+        // and flags, the ones of two or more targets are shared in first seen order,
+        // a target only pulls the objects it uses
+        auto unitOf = [](const TargetSources& info, const std::string& file) {
+            auto flags = info.flags.find(file);
+            return flags != info.flags.end() ? file + "\n" + flags->second : file;
+        };
+        std::map<std::string, int> counts;
+        std::vector<std::pair<std::string, size_t>> order;
+        for (size_t j = 0; j < members.size(); ++j) {
+            const TargetSources& info = targets[members[j]];
+            std::set<std::string> seen;
+            for (auto iter = info.files.begin(); iter != info.files.end(); ++iter) {
+                std::string unit = unitOf(info, *iter);
+                if (seen.insert(unit).second && ++counts[unit] == 1) {
+                    order.push_back({std::move(unit), j});
+                }
+            }
+        }
+        std::set<std::string> shared;
+        SharedLib lib;
+        for (auto iter = order.begin(); iter != order.end(); ++iter) {
+            if (counts[iter->first] > 1) {
+                shared.insert(iter->first);
+                const std::string file = iter->first.substr(0, iter->first.find('\n'));
+                const TargetSources& info = targets[members[iter->second]];
+                auto flags = info.flags.find(file);
+                if (flags != info.flags.end()) {
+                    lib.flags[file] = flags->second;
+                }
+                lib.files.push_back(file);
+            }
+        }
+        if (shared.empty()) {
+            continue;
+        }
+        const TargetSources& first = targets[members[0]];
+        lib.name = std::string(SXcodeSources::Shared_Prefix) + first.name;
+        lib.target = Impl::getOrNewStaticLibTarget(lib.name.c_str(), first.target);
+        if (!lib.target) {
+            LOG_E("Unable to make target %s\n", lib.name.c_str());
+            return false;
+        }
+        int linked = 0;
+        for (size_t j = 0; j < members.size(); ++j) {
+            TargetSources& info = targets[members[j]];
+            const size_t count = info.files.size();
+            info.files.erase(std::remove_if(info.files.begin(), info.files.end(), [&](const std::string& file) {
+                return shared.find(unitOf(info, file)) != shared.end();
+            }), info.files.end());
+            if (count == info.files.size()) {
+                continue;
+            }
+            // the linker would drop +load methods, categories and static
+            // initializers of the objects nothing refers to
+            if (!Impl::targetLinkLibrary(info.target, lib.target) || !Impl::targetSetSharedLdflags(info.target, lib.target)) {
+                LOG_E("Unable to link %s to %s\n", lib.name.c_str(), info.name.c_str());
+                return false;
+            }
+            ++linked;
+        }
+        LOG_I("Shared %d sources of %d targets in %s\n", (int)lib.files.size(), linked, lib.name.c_str());
+        libs.push_back(std::move(lib));
+    }
+
+    // generated targets are rebuilt from libs, the ones not made again are emptied
+    for (auto iter = targets.begin(); iter != targets.end(); ++iter) {
+        if (iter->generated) {
+            iter->loaded = true;
+            iter->files.clear();
+            iter->flags.clear();
+        }
+    }
+    for (auto lib = libs.begin(); lib != libs.end(); ++lib) {
+        auto iter = targets.begin();
+        while (iter != targets.end() && iter->target != lib->target) {
+            ++iter;
+        }
+        if (iter == targets.end()) {
+            targets.push_back(TargetSources());
+            iter = targets.end() - 1;
+            iter->target = lib->target;
+            iter->name = lib->name;
+            iter->generated = true;
+            iter->loaded = true;
+        }
+        iter->files = std::move(lib->files);
+        iter->flags = std::move(lib->flags);
+    }
+    return true;
+}
+
+bool XcodeProjUnifier::removeSharedLibs(std::vector<TargetSources>& targets) {
+    for (auto iter = targets.begin(); iter != targets.end();) {
+        if (!iter->generated) {
+            ++iter;
+            continue;
+        }
+        if (!Impl::removeStaticLibTarget(iter->target)) {
+            LOG_E("Unable to remove target %s\n", iter->name.c_str());
+            return false;
+        }
+        LOG_I("Removed %s\n", iter->name.c_str());
+        iter = targets.erase(iter);
+    }
+    return true;
+}
+
+void XcodeProjUnifier::sortLongestFirst(const char* proj_path, std::vector<std::string>& files, const std::map<std::string, const std::string*>& contents) {
+    for (auto iter = files.begin(); iter != files.end(); ++iter) {
+        if (_costs.find(*iter) != _costs.end()) {
+            continue;
+        }
+        uint64_t cost = 0;
+        auto content = contents.find(*iter);
+        if (content != contents.end()) {
+            std::vector<std::string> sources;
+            unifiedSources(*content->second, sources);
+            for (auto source = sources.begin(); source != sources.end(); ++source) {
+                std::string path = shared::Path(proj_path, source->c_str()).string();
+                cost += fileSize(path.c_str());
+                _sizedFiles.insert(path);
+            }
+        } else {
+            std::string path = shared::Path(proj_path, iter->c_str()).string();
+            cost = fileSize(path.c_str());
+            _sizedFiles.insert(path);
+        }
+        _costs[*iter] = cost;
+    }
+    SSources::SortByCost(proj_path, files, _costs);
+}
+
+uint64_t XcodeProjUnifier::targetFingerprint(const TargetSources& info, const std::map<std::string, const std::string*>& contents) {
+    shared::StrBuf buf;
+    buf.appendf("unified=%d\n", (int)_unified);
+    for (auto iter = _switchConfigs.begin(); iter != _switchConfigs.end(); ++iter) {
+        buf.appendf("switch=%s\n", iter->c_str());
+    }
+    buf.appendf("longest=%d\n", (int)_longestFirst);
+    for (auto iter = info.files.begin(); iter != info.files.end(); ++iter) {
+        buf.appendf("%s\n", iter->c_str());
+        if (_longestFirst) {
+            auto cost = _costs.find(*iter);
+            buf.appendf("cost=%llu\n", cost != _costs.end() ? (unsigned long long)cost->second : 0ULL);
+        }
+        auto flags = info.flags.find(*iter);
+        if (flags != info.flags.end()) {
+            buf.appendf("flags=%s\n", flags->second.c_str());
+        }
+        auto content = contents.find(*iter);
+        if (content != contents.end()) {
+            buf.append(*content->second);
+        }
+    }
+
+    // the project entries the target is made of
+    auto writeObject = [&](NeXTSTEP::Object* obj) {
+        if (obj) {
+            obj->write(0, buf);
+        }
+        buf.append('\n');
+    };
+    writeObject(info.target);
+    NeXTSTEP::Object* build_phase = Impl::targetGetSourcesBuildPhase(info.target);
+    NeXTSTEP::Array* build_files = build_phase ? build_phase->arrayByKey("files") : NULL;
+    writeObject(build_phase);
+    if (build_files) {
+        for (auto iter = build_files->begin(); iter != build_files->end(); ++iter) {
+            NeXTSTEP::Object* buildFile = iter->isString() ? object(iter->string()) : NULL;
+            writeObject(buildFile);
+            writeObject(buildFile ? object(buildFile->stringByKey("fileRef")) : NULL);
+        }
+    }
+    NeXTSTEP::Object* list = object(info.target->stringByKey("buildConfigurationList"));
+    NeXTSTEP::Array* configs = list ? list->arrayByKey("buildConfigurations") : NULL;
+    writeObject(list);
+    if (configs) {
+        for (auto iter = configs->begin(); iter != configs->end(); ++iter) {
+            writeObject(iter->isString() ? object(iter->string()) : NULL);
+        }
+    }
+    NeXTSTEP::Object* target_group = Impl::targetFindUnifiedRoot(info.name.c_str());
+    NeXTSTEP::Array* target_children = target_group ? target_group->arrayByKey("children") : NULL;
+    writeObject(target_group);
+    if (target_children) {
+        for (auto iter = target_children->begin(); iter != target_children->end(); ++iter) {
+            writeObject(iter->isString() ? object(iter->string()) : NULL);
+        }
+    }
+    return HashData(buf.c_str(), buf.length());
+}
+
 bool XcodeProjUnifier::makeXcodeproj(const char* proj_path, const char* proj_name) {
-    std::string content;
+    // nothing read or written by the last run changed, skip parsing
+    std::string stampName = std::string(SXcodeSources::Unified_Path) + "." + proj_name + ".stamp";
+    shared::Path stampPath(proj_path, stampName.c_str());
+    shared::StrBuf stampHeader;
+    stampHeader.appendf("xcodeproj_unifier %s unified=%d shared=%d longest=%d switch=", CPP_BUILD_UNIFIER_VERSION, _unified ? 1 : 0, _sharedLib ? 1 : 0, _longestFirst ? 1 : 0);
+    for (auto iter = _switchConfigs.begin(); iter != _switchConfigs.end(); ++iter) {
+        stampHeader.appendf("%s,", iter->c_str());
+    }
+    FileStamp stamp(std::string(stampHeader.c_str(), stampHeader.length()));
+    if (stamp.unchanged(stampPath.c_str())) {
+        LOG_I("Unchanged %s\n", proj_name);
+        return true;
+    }
+
+    // parsed in place in a copy on write mapping, the read only one is the
+    // original text, the project points into both until it is written
+    MappedFile content;
+    MappedFile original;
     shared::Path projFilePath(proj_path, proj_name);
     shared::Path projFileName(projFilePath.c_str(), "project.pbxproj");
-    if (!loadContent(projFileName.c_str(), content) || content.length() == 0) {
+    if (!content.open(projFileName.c_str(), true) || !original.open(projFileName.c_str())) {
         LOG_E("Unable to load %s\n", projFileName.c_str());
         return false;
     }
 
-    if (!Impl::inlineParse((char*)content.c_str())) {
-        LOG_E("Invalid project\n");
-        return false;
+    std::string snapshotName = std::string(SXcodeSources::Unified_Path) + "." + proj_name + ".snapshot";
+    shared::Path snapshotPath(proj_path, snapshotName.c_str());
+    if (_snapshot && Impl::loadSnapshot(snapshotPath.c_str(), content.writableData())) {
+        LOG_I("Use snapshot %s\n", snapshotPath.c_str());
+    } else {
+        if (!Impl::inlineParse(content.writableData(), _parseJobs, original.data())) {
+            LOG_E("Invalid project\n");
+            return false;
+        }
+        if (_snapshot && !Impl::saveSnapshot(snapshotPath.c_str())) {
+            LOG_W("Unable to save %s\n", snapshotPath.c_str());
+        }
     }
 
     std::set<std::string> allFiles;
@@ -68,120 +539,328 @@ bool XcodeProjUnifier::makeXcodeproj(const char* proj_path, const char* proj_nam
 
     printInfosToFile(projFileName.string() + ".1");
 
+    std::vector<TargetSources> targets(targetCount());
+    // targets mostly scan the same dirs
+    SDirCache dirCache;
+    bool hasSharedLib = false;
     for (size_t i = 0; i < targetCount(); ++i) {
-        SXcodeSources srcs;
-        srcs.setUnified(_unified);
-        auto target = Impl::target(i);
-        const char* targetName = target->stringByKey("name");
+        auto& info = targets[i];
+        info.target = Impl::target(i);
+        info.loaded = false;
+        info.generated = false;
+        const char* targetName = info.target->stringByKey("name");
         if (!targetName) {
             return false;
         }
-        std::string targetName_ss(targetName);
-        if (targetName_ss.length() > 2) {
-            if (targetName_ss[0] == '"' && targetName_ss.back() == '"') {
-                targetName_ss = targetName_ss.substr(1, targetName_ss.length() - 2);
+        info.name = targetName;
+        if (info.name.length() > 2) {
+            if (info.name[0] == '"' && info.name.back() == '"') {
+                info.name = info.name.substr(1, info.name.length() - 2);
             }
-            targetName = targetName_ss.c_str();
         }
-        srcs.setAllFiles(&allFiles);
-        LOG_W_ONLY(printf("========== %s ==========\n", targetName));
-        if (!srcs.loadList(proj_path, targetName)) {
-            LOG_W("Skip target %s\n", targetName);
-            continue;
+        info.generated = isBeginWith(info.name, SXcodeSources::Shared_Prefix);
+        hasSharedLib = hasSharedLib || info.generated;
+        info.srcs.setUnified(_unified);
+        info.srcs.setDeferUnified(true);
+        info.srcs.setAllFiles(&allFiles);
+        info.srcs.setDirCache(&dirCache);
+    }
+
+    // sources moved to a shared library have their flags there
+    for (auto iter = targets.begin(); iter != targets.end(); ++iter) {
+        if (iter->generated) {
+            readSourceFlags(proj_path, *iter);
         }
-        NeXTSTEP::Array* build_files = Impl::targetGetBuildFiles(target);
-        if (!build_files) {
-            return false;
+    }
+
+    // scan sources of all targets in parallel, only reads the project
+    shared::ParallelFor(targets.size(), _jobs, [&](size_t i) {
+        auto& info = targets[i];
+        if (!info.generated) {
+            readSourceFlags(proj_path, info);
+            for (auto lib = targets.begin(); lib != targets.end(); ++lib) {
+                if (lib->generated && Impl::targetDependsOn(info.target, lib->target)) {
+                    info.sourceFlags.insert(lib->sourceFlags.begin(), lib->sourceFlags.end());
+                }
+            }
+            info.srcs.setFileGroups(&info.sourceFlags);
+            info.loaded = info.srcs.loadList(proj_path, info.name.c_str());
+            info.files = info.srcs.files();
+            for (auto iter = info.files.begin(); iter != info.files.end(); ++iter) {
+                const std::string* flags = info.srcs.group(*iter);
+                if (flags) {
+                    info.flags[*iter] = *flags;
+                }
+            }
         }
+    });
 
-        // cleanup build files
-        {
-            bool skipInc = false;
-            for (auto iter = build_files->begin(); iter != build_files->end(); skipInc = skipInc ? false : (++iter, false)) {
-                if (iter->isString()) {
-                    pbxproj::ProjectItem buildFile(_objects->objectByKey(iter->string()));
-                    if (!buildFile.isa("PBXBuildFile")) {
-                        return false;
-                    }
-                    NeXTSTEP::Object* fileRef = _objects->objectByKey(buildFile->stringByKey("fileRef"));
-                    if (!fileRef) {
-                        return false;
-                    }
-                    skipInc = true;
-                    _pathmap.erase(iter->string());
-                    removeItem(iter->string());
-                    iter = build_files->erase(iter);
+    std::map<std::string, const std::string*> unifiedContents;
+    if (!writeUnifiedFiles(proj_path, targets, unifiedContents)) {
+        return false;
+    }
+
+    // shared libraries follow -shared, without it the ones made before are removed
+    if (_sharedLib ? !extractSharedLibs(targets) : (hasSharedLib && !removeSharedLibs(targets))) {
+        return false;
+    }
+
+    if (_longestFirst) {
+        for (auto iter = targets.begin(); iter != targets.end(); ++iter) {
+            if (iter->loaded) {
+                sortLongestFirst(proj_path, iter->files, unifiedContents);
+            }
+        }
+    }
+
+    // fingerprints of the targets when last made, the project entries of the
+    // unchanged ones are not edited, a run with nothing changed at all is
+    // skipped before parsing by the stamp
+    std::string stateName = std::string(SXcodeSources::Unified_Path) + "." + proj_name + ".state";
+    shared::Path statePath(proj_path, stateName.c_str());
+    std::map<std::string, uint64_t> lastState;
+    {
+        std::string content;
+        if (loadContent(statePath.c_str(), content)) {
+            std::istringstream is(content);
+            std::string line;
+            while (std::getline(is, line)) {
+                auto tab = line.rfind('\t');
+                if (tab != std::string::npos) {
+                    lastState[line.substr(0, tab)] = strtoull(line.c_str() + tab + 1, NULL, 16);
                 }
             }
         }
+    }
 
-        NeXTSTEP::Object* target_group = Impl::targetGetUnifiedRoot(targetName);
-        if (!target_group) {
+    // apply to project in target order
+    const std::string begin_common = std::string(SXcodeSources::Unified_Path) + "/" + SXcodeSources::Common_Name + "/";
+    NeXTSTEP::Object* common_group = NULL;
+    for (auto iterTarget = targets.begin(); iterTarget != targets.end(); ++iterTarget) {
+        auto target = iterTarget->target;
+        const char* targetName = iterTarget->name.c_str();
+        if (!iterTarget->loaded) {
+            if (!iterTarget->generated) {
+                LOG_W_ONLY(ELogLevel::Print(stdout, "========== %s ==========\n", targetName));
+                LOG_W("Skip target %s\n", targetName);
+            }
+            continue;
+        }
+        LOG_W_ONLY(ELogLevel::Print(stdout, "========== %s ==========\n", targetName));
+        auto last = lastState.find(iterTarget->name);
+        if (last != lastState.end() && last->second == targetFingerprint(*iterTarget, unifiedContents)) {
+            LOG_I("Unchanged target %s\n", targetName);
+            if (_stats && !iterTarget->generated) {
+                iterTarget->srcs.printStats();
+            }
+            continue;
+        }
+        // with -switch the sources of unified files are built too, each
+        // configuration excludes one of them
+        std::vector<std::string> files = iterTarget->files;
+        std::map<std::string, std::string> flags = iterTarget->flags;
+        std::vector<std::string> unifiedFiles;
+        std::vector<std::string> perFileSources;
+        if (!_switchConfigs.empty()) {
+            for (auto iter = iterTarget->files.begin(); iter != iterTarget->files.end(); ++iter) {
+                auto content = unifiedContents.find(*iter);
+                if (content == unifiedContents.end()) {
+                    continue;
+                }
+                unifiedFiles.push_back(*iter);
+                std::vector<std::string> sources;
+                unifiedSources(*content->second, sources);
+                auto unifiedFlags = iterTarget->flags.find(*iter);
+                for (auto source = sources.begin(); source != sources.end(); ++source) {
+                    if (unifiedFlags != iterTarget->flags.end()) {
+                        flags[*source] = unifiedFlags->second;
+                    }
+                    files.push_back(*source);
+                    perFileSources.push_back(*source);
+                }
+            }
+            if (_longestFirst) {
+                sortLongestFirst(proj_path, files, unifiedContents);
+            }
+        }
+        NeXTSTEP::Object* build_phase = Impl::targetGetSourcesBuildPhase(target);
+        NeXTSTEP::Array* build_files = build_phase ? build_phase->arrayByKey("files") : NULL;
+        if (!build_files) {
             return false;
         }
-        {
-            NeXTSTEP::Array* target_children = target_group->arrayByKey("children");
-            if (!target_children) {
+
+        const std::string begin_unified = std::string(SXcodeSources::Unified_Path) + "/";
+        bool hasCommon = false;
+        bool hasUnified = false;
+        for (auto iter = files.begin(); iter != files.end(); ++iter) {
+            if (isBeginWith(*iter, begin_common)) {
+                hasCommon = true;
+            } else if (isBeginWith(*iter, begin_unified)) {
+                hasUnified = true;
+            }
+        }
+        if (hasCommon && !common_group) {
+            common_group = Impl::targetGetUnifiedRoot(SXcodeSources::Common_Name);
+            if (!common_group) {
                 return false;
             }
+        }
+        // a shared library of plain sources gets no group
+        NeXTSTEP::Object* target_group = NULL;
+        if (iterTarget->generated && !hasUnified) {
+            target_group = Impl::targetFindUnifiedRoot(targetName);
+        } else {
+            target_group = Impl::targetGetUnifiedRoot(targetName);
+            if (!target_group) {
+                return false;
+            }
+        }
 
-            // cleanup target group
-            for (auto iter = target_children->begin(); iter != target_children->end(); ++iter) {
-                if (iter->isString()) {
-                    _pathmap.erase(iter->string());
-                    removeItem(iter->string());
+        // build files and unified files of the target are replaced in one edit,
+        // the unified files still listed are kept
+        Edit edit(*this);
+        for (auto iter = build_files->begin(); iter != build_files->end(); ++iter) {
+            if (iter->isString()) {
+                pbxproj::ProjectItem buildFile(object(iter->string()));
+                if (!buildFile.isa(pbxproj::IsaType::PBXBuildFile)) {
+                    return false;
                 }
+                NeXTSTEP::Object* fileRef = object(buildFile->stringByKey("fileRef"));
+                if (!fileRef) {
+                    return false;
+                }
+                edit.remove(iter->string());
             }
-            target_children->clear();
-        }
-
-        {
-            const std::string begin_unified = std::string(SXcodeSources::Unified_Path) + "/";
-            for (auto iter = srcs.files().begin(); iter != srcs.files().end(); ++iter) {
-                const auto& path = *iter;
-                std::string build_key;
-                std::string file_key;
-                std::string path_dir, path_file;
-                {
-                    auto file_pos = path.rfind("/");
-                    path_file = path.substr(file_pos + 1);
-                    if (std::string::npos != file_pos) {
-                        path_dir = path.substr(0, file_pos);
-                    }
-                    build_key = Impl::KeyForBuildFile(path_dir.c_str(), path_file.c_str(), targetName);
-                    file_key = Impl::KeyForGroupOrFile(path_dir.c_str(), path_file.c_str());
+        }
+
+        std::vector<std::string> build_keys;
+        std::set<std::string, bool(*)(const std::string&, const std::string&)> added(stricasecmp);
+        pbxproj::ObjectKey_set unified_keys;
+        std::vector<std::string> unified_key_strings;
+        for (auto iter = files.begin(); iter != files.end(); ++iter) {
+            const auto& path = *iter;
+            std::string build_key;
+            std::string file_key;
+            std::string path_dir, path_file;
+            {
+                auto file_pos = path.rfind("/");
+                path_file = path.substr(file_pos + 1);
+                if (std::string::npos != file_pos) {
+                    path_dir = path.substr(0, file_pos);
                 }
+            }
+            if (!added.insert(path).second) {
+                LOG_W("Skip duplicated %s\n", path.c_str());
+                continue;
+            }
+            build_key = Impl::newKey(Impl::IdForBuildFile(path_dir.c_str(), path_file.c_str(), targetName), (path_file + " in Sources").c_str(), edit);
 
-                if (isBeginWith(path, begin_unified)) {
-                    if (!getOrNewChildFile(target_group, path_file.c_str())) {
-                        return false;
-                    }
-                } else {
-                    // find org fileRef and file_key from path
-                    const pbxproj::PBXPath* pathInfo = Impl::findGroupOrFilePath(path.c_str());
-                    if (!pathInfo) {
-                        return false;
-                    }
+            if (isBeginWith(path, begin_common)) {
+                file_key = getOrNewChildFile(edit, common_group, path_file.c_str());
+            } else if (isBeginWith(path, begin_unified)) {
+                file_key = getOrNewChildFile(edit, target_group, path_file.c_str());
+                unified_key_strings.push_back(file_key);
+            } else {
+                // find org fileRef and file_key from path
+                const pbxproj::PBXPath* pathInfo = Impl::findGroupOrFilePath(path.c_str());
+                if (pathInfo) {
                     file_key = pathInfo->key;
                 }
+            }
+            if (file_key.empty()) {
+                return false;
+            }
 
-                NeXTSTEP::Object* buildFile = new NeXTSTEP::Object();
-                buildFile->set("isa", "PBXBuildFile");
-                buildFile->set("fileRef", file_key.c_str());
+            NeXTSTEP::Object* buildFile = new NeXTSTEP::Object();
+            buildFile->set("isa", "PBXBuildFile");
+            buildFile->set("fileRef", file_key.c_str());
+            auto fileFlags = flags.find(path);
+            if (fileFlags != flags.end()) {
+                NeXTSTEP::Object* settings = new NeXTSTEP::Object();
+                settings->set("COMPILER_FLAGS", fileFlags->second.c_str());
+                buildFile->set("settings", settings);
+            }
 
-                addItem(new NeXTSTEP::KeyValue(build_key.c_str(), buildFile));
+            edit.add(new NeXTSTEP::KeyValue(build_key.c_str(), buildFile));
+            build_keys.push_back(build_key);
+        }
+        edit.rewrite(build_phase, "files", std::move(build_keys));
 
-                build_files->push_back(NeXTSTEP::Value::NewString(build_key.c_str()));
+        // drop the unified files of the target no longer listed
+        for (auto iter = unified_key_strings.begin(); iter != unified_key_strings.end(); ++iter) {
+            unified_keys.insert(iter->c_str());
+        }
+        std::vector<std::string>* children = target_group ? edit.values(target_group, "children") : NULL;
+        if (target_group && !children) {
+            return false;
+        }
+        if (children) {
+            auto dst = children->begin();
+            for (auto iter = children->begin(); iter != children->end(); ++iter) {
+                if (unified_keys.find(iter->c_str()) != unified_keys.end()) {
+                    if (dst != iter) {
+                        *dst = std::move(*iter);
+                    }
+                    ++dst;
+                } else {
+                    edit.remove(iter->c_str());
+                }
             }
+            children->erase(dst, children->end());
         }
-        if (_stats) {
-            srcs.printStats();
+        if (!edit.commit()) {
+            return false;
+        }
+        if (!Impl::targetSetUnifiedExcludes(target, _switchConfigs, excludePatterns(unifiedFiles, files), excludePatterns(perFileSources, files))) {
+            return false;
         }
+        if (_stats && !iterTarget->generated) {
+            iterTarget->srcs.printStats();
+        }
+    }
+
+    if (!removeUnusedCommonFiles(targets)) {
+        return false;
     }
 
     printInfosToFile(projFileName.string() + ".2");
 
-    shared::StrBuf buf;
-    Impl::write(buf);
-    return saveContentWithCheck(projFileName.c_str(), buf);
+    if (Impl::modified()) {
+        FileWriterWithCheck out(projFileName.c_str());
+        if (!Impl::write(out)) {
+            return false;
+        }
+    } else {
+        LOG_I("Unchanged %s\n", projFileName.c_str());
+    }
+
+    // skipped targets keep their last fingerprints
+    shared::StrBuf state;
+    for (auto iter = targets.begin(); iter != targets.end(); ++iter) {
+        auto last = lastState.find(iter->name);
+        if (iter->loaded) {
+            state.appendf("%s\t%016llx\n", iter->name.c_str(), (unsigned long long)targetFingerprint(*iter, unifiedContents));
+        } else if (last != lastState.end()) {
+            state.appendf("%s\t%016llx\n", iter->name.c_str(), (unsigned long long)last->second);
+        }
+    }
+    if (!saveContentWithCheck(statePath.c_str(), std::string(state.c_str(), state.length()))) {
+        LOG_W("Unable to save %s\n", statePath.c_str());
+    }
+
+    // inputs of the run and the outputs that can be changed by others
+    stamp.add(projFileName.string());
+    stamp.add(shared::Path(proj_path, SXcodeSources::Unified_Path).string());
+    for (auto iter = targets.begin(); iter != targets.end(); ++iter) {
+        stamp.add(iter->srcs.inputs().begin(), iter->srcs.inputs().end());
+    }
+    for (auto iter = unifiedContents.begin(); iter != unifiedContents.end(); ++iter) {
+        stamp.add(shared::Path(proj_path, iter->first.c_str()).dir());
+    }
+    // the order of -longest changes with the sizes of the sources
+    stamp.addSize(_sizedFiles.begin(), _sizedFiles.end());
+    if (!stamp.save(stampPath.c_str())) {
+        LOG_W("Unable to save %s\n", stampPath.c_str());
+    }
+    return true;
 }
@@ -21,11 +21,12 @@
 #ifndef XcodeProjUnifier_hpp__
 #define XcodeProjUnifier_hpp__
 #include "UnifiedXcodeProject.hpp"
+#include "SXcodeSources.h"
 
 class XcodeProjUnifier : private UnifiedXcodeProject {
     typedef UnifiedXcodeProject Impl;
 public:
-    XcodeProjUnifier() : _unified(true), _stats(false) {
+    XcodeProjUnifier() : _unified(true), _stats(false), _snapshot(false), _sharedLib(false), _longestFirst(false), _jobs(0), _parseJobs(1) {
 
     }
 
@@ -33,8 +34,72 @@ public:
 
     void printInfosToFile(std::string name);
 
+private:
+    struct TargetSources {
+        NeXTSTEP::Object* target;
+        std::string name;
+        SXcodeSources srcs;
+        // sources to build, srcs.files() with common unified files and without
+        // the ones moved to a shared library
+        std::vector<std::string> files;
+        // COMPILER_FLAGS of sources read from the project, the ones in a
+        // unified file have the flags of it
+        std::map<std::string, std::string> sourceFlags;
+        // COMPILER_FLAGS of files
+        std::map<std::string, std::string> flags;
+        bool loaded;
+        // a shared library target made by extractSharedLibs()
+        bool generated;
+    };
+
+    // map<file, estimated compile cost>, see sortLongestFirst()
+    std::map<std::string, uint64_t> _costs;
+    // paths of the files sized for _costs
+    std::set<std::string> _sizedFiles;
+
+    // hash of the sources and options of the target and of the project entries
+    // made of them, a target with the fingerprint of its last run keeps its
+    // project entries, its list and unified files are still made as the common
+    // files and shared libraries depend on all targets
+    uint64_t targetFingerprint(const TargetSources& info, const std::map<std::string, const std::string*>& contents);
+
+    // reads COMPILER_FLAGS of the build files of the target before it is cleaned up
+    void readSourceFlags(const char* proj_path, TargetSources& info);
+
+    // writes the unified files of all targets, the ones identical in several
+    // targets once in the common dir, and points files of targets to it
+    // contents gets the path and content of every unified file
+    bool writeUnifiedFiles(const char* proj_path, std::vector<TargetSources>& targets, std::map<std::string, const std::string*>& contents);
+    // removes the files of the common group that no target builds
+    bool removeUnusedCommonFiles(const std::vector<TargetSources>& targets);
+
+    // orders files by descending compile cost, the size of a source or the
+    // sizes of the sources of a unified file, costs are kept in _costs
+    void sortLongestFirst(const char* proj_path, std::vector<std::string>& files, const std::map<std::string, const std::string*>& contents);
+
+    // moves sources built by two or more targets of the same compile settings to a
+    // static library target that they link, generated targets are appended
+    bool extractSharedLibs(std::vector<TargetSources>& targets);
+    // removes the targets made by extractSharedLibs() and the links to them
+    bool removeSharedLibs(std::vector<TargetSources>& targets);
+
+public:
+
     bool _stats;
     bool _unified;
+    // keep a snapshot of the parsed project next to the unified dir
+    bool _snapshot;
+    // build sources shared by targets once in a static library target
+    bool _sharedLib;
+    // configurations building the sources of unified files, empty builds unified
+    // files only, otherwise all are in the project and the others build unified files
+    std::vector<std::string> _switchConfigs;
+    // build phases start with the files costing the most to compile
+    bool _longestFirst;
+    // threads to scan targets, 0 for hardware concurrency
+    size_t _jobs;
+    // threads to parse a large project, only with an explicit -j
+    size_t _parseJobs;
 };
 
 #endif//XcodeProjUnifier_hpp__
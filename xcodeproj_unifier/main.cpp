@@ -22,17 +22,52 @@
 #include "XcodeProjUnifier.hpp"
 #include <stdio.h>
 #include <stdint.h>
+#include <ctype.h>
 #include <shared/utils/Path.h>
+#include <shared/utils/ParallelFor.h>
 #include <unistd.h>
 #include "shared/str_utils.h"
 #include "shared/file_utils.h"
 #include <dirent.h>
+#include <set>
+#include <algorithm>
 
 bool isProjectFile(const char* file) {
     const char* ext = fileext(file, ".");
     return strcmp(ext, ".xcodeproj") == 0;
 }
 
+bool isWorkspaceFile(const char* file) {
+    const char* ext = fileext(file, ".");
+    return strcmp(ext, ".xcworkspace") == 0;
+}
+
+struct ProjectPath {
+    std::string dir;
+    std::string name;
+};
+
+struct ProjectList {
+    std::vector<ProjectPath> projects;
+    std::set<std::string> added;
+
+    void add(const std::string& dir, const std::string& name) {
+        std::string proj_name = name;
+        std::string xcodeproj = ".xcodeproj";
+        if (!isEndOf(proj_name, xcodeproj)) {
+            proj_name.append(xcodeproj);
+        }
+        if (added.insert(shared::Path(dir.c_str(), proj_name.c_str()).string()).second) {
+            projects.push_back({dir, proj_name});
+        }
+    }
+
+    void add(const char* fullpath) {
+        shared::Path path(fullpath);
+        add(path.dir(), path.name());
+    }
+};
+
 bool findProjects(const char* path, std::vector<std::string>& projects) {
     DIR* dir = opendir(path);
     if (!dir) {
@@ -60,32 +95,223 @@ bool findProjects(const char* path, std::vector<std::string>& projects) {
     return true;
 }
 
+// value of attribute name in the tag [begin, end) of xml
+static std::string xmlAttribute(const char* begin, const char* end, const char* name) {
+    const size_t nameLength = strlen(name);
+    for (const char* p = begin; p + nameLength < end; ++p) {
+        if (strncmp(p, name, nameLength) != 0 || (p != begin && !isspace(p[-1]))) {
+            continue;
+        }
+        const char* q = p + nameLength;
+        while (q < end && isspace(*q)) {
+            ++q;
+        }
+        if (q >= end || *q != '=') {
+            continue;
+        }
+        ++q;
+        while (q < end && isspace(*q)) {
+            ++q;
+        }
+        if (q >= end || (*q != '"' && *q != '\'')) {
+            continue;
+        }
+        const char quote = *q++;
+        const char* valueEnd = (const char*)memchr(q, quote, end - q);
+        if (!valueEnd) {
+            break;
+        }
+        return std::string(q, valueEnd - q);
+    }
+    return std::string();
+}
+
+// resolve location "group:", "container:", "absolute:" or "self:" of a workspace item
+static bool resolveLocation(const std::string& location, const std::string& group, const std::string& container, std::string& out) {
+    auto colon = location.find(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    std::string type = location.substr(0, colon);
+    std::string path = location.substr(colon + 1);
+    if (type == "group") {
+        out = shared::Path(group.c_str(), path.c_str()).string();
+    } else if (type == "container") {
+        out = shared::Path(container.c_str(), path.c_str()).string();
+    } else if (type == "absolute") {
+        out = shared::Path(path.c_str()).string();
+    } else if (type == "self") {
+        out = shared::Path(container.c_str(), path.c_str()).string();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// add projects referenced by workspace/contents.xcworkspacedata
+bool findWorkspaceProjects(const char* workspace, ProjectList& projects) {
+    std::string content;
+    shared::Path dataPath(workspace, "contents.xcworkspacedata");
+    if (!loadContent(dataPath.c_str(), content)) {
+        LOG_E("Unable to load %s\n", dataPath.c_str());
+        return false;
+    }
+    const std::string container = shared::Path(workspace).dir();
+    std::vector<std::string> groups;
+    groups.push_back(container);
+    const char* cur = content.c_str();
+    const char* end = cur + content.length();
+    while ((cur = (const char*)memchr(cur, '<', end - cur)) != NULL) {
+        const char* tagEnd = (const char*)memchr(cur, '>', end - cur);
+        if (!tagEnd) {
+            break;
+        }
+        if (strncmp(cur, "</Group", 7) == 0) {
+            if (groups.size() > 1) {
+                groups.pop_back();
+            }
+        } else if (strncmp(cur, "<Group", 6) == 0 || strncmp(cur, "<FileRef", 8) == 0) {
+            const bool group = cur[1] == 'G';
+            std::string location = xmlAttribute(cur, tagEnd, "location");
+            std::string path;
+            if (!resolveLocation(location, groups.back(), container, path)) {
+                path = groups.back();
+            }
+            if (group) {
+                if (tagEnd[-1] != '/') {
+                    groups.push_back(path);
+                }
+            } else if (isProjectFile(path.c_str())) {
+                projects.add(path.c_str());
+            }
+        }
+        cur = tagEnd + 1;
+    }
+    return true;
+}
+
+// add all projects under path and the projects referenced by the workspaces under path
+bool findProjectsRecursive(const char* path, ProjectList& projects) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+        LOG_E_ONLY(perror(path));
+        return false;
+    }
+    std::vector<std::string> names;
+    struct dirent* item;
+    while ((item = readdir(dir)) != NULL) {
+        if (item->d_name[0] == '.' || item->d_name[0] == '@') {
+            continue;
+        }
+        names.push_back(item->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    struct stat info;
+    for (auto iter = names.begin(); iter != names.end(); ++iter) {
+        shared::Path sub(path, iter->c_str());
+        if (stat(sub.c_str(), &info) < 0) {
+            LOG_E_ONLY(perror(sub.c_str()));
+            continue;
+        }
+        if (!S_ISDIR(info.st_mode)) {
+            continue;
+        }
+        if (isProjectFile(iter->c_str())) {
+            projects.add(path, *iter);
+        } else if (isWorkspaceFile(iter->c_str())) {
+            findWorkspaceProjects(sub.c_str(), projects);
+        } else {
+            findProjectsRecursive(sub.c_str(), projects);
+        }
+    }
+    return true;
+}
+
 void help(const char* cmd) {
-    printf("xcode project unifier, v2022.0914, Copyright 2018-2022 bianchui@github.com .\n");
-    printf("usage:\n%s [-no] [-project projname] [dir]\n", cmd);
+    printf("xcode project unifier, " CPP_BUILD_UNIFIER_VERSION ", Copyright 2018-2022 bianchui@github.com .\n");
+    printf("usage:\n%s [-no] [-j N] [-r] [-snapshot] [-shared] [-switch[=configs]] [-longest] [-project projname] [-workspace wsname] [dir]\n", cmd);
     printf("  -no       disable unifier\n");
+    printf("  -j N      run with N threads, default is one per cpu, a large project\n");
+    printf("            is parsed in parallel only when given\n");
+    printf("  -snapshot keep parsed project in @unified_targets.projname.snapshot to skip parsing\n");
+    printf("  -shared   build sources shared by targets of the same compile settings once\n");
+    printf("            in a static library target, removed by a run without it\n");
+    printf("  -switch[=configs]\n");
+    printf("            put both sources and unified files in targets, configurations in\n");
+    printf("            comma separated configs (default Debug) build the sources and the\n");
+    printf("            others the unified files, by EXCLUDED_SOURCE_FILE_NAMES\n");
+    printf("  -longest  list the files costing the most to compile first in build phases,\n");
+    printf("            by the sizes of their sources\n");
+    printf("  -r        all projects under dir and referenced by workspaces under dir\n");
+    printf("  -workspace wsname\n");
+    printf("            projects referenced by workspace\n");
 }
 
 int main(const int argc, const char * argv[]) {
     const char* cwd = getcwd(NULL, 0);
     const char* srcdir = NULL;
     const char* projName = NULL;
-    XcodeProjUnifier unifier;
+    const char* workspaceName = NULL;
+    bool recursive = false;
+    bool unified = true;
+    bool stats = false;
+    bool snapshot = false;
+    bool sharedLib = false;
+    bool longestFirst = false;
+    std::vector<std::string> switchConfigs;
+    size_t jobs = 0;
+    bool explicitJobs = false;
     for (int i = 1; i < argc; ++i) {
         if (argv[i][0] == '-') {
             if (0 == strcasecmp(argv[i] + 1, "h") || 0 == strcasecmp(argv[i] + 1, "help")) {
                 help(argv[0]);
                 return 0;
             } else if (0 == strcasecmp(argv[i] + 1, "no")) {
-                unifier._unified = false;
+                unified = false;
+            } else if (argv[i][1] == 'j' && (argv[i][2] == 0 || isdigit(argv[i][2]))) {
+                const char* jobsArg = argv[i] + 2;
+                if (!*jobsArg && i + 1 < argc) {
+                    jobsArg = argv[++i];
+                }
+                jobs = (size_t)atoi(jobsArg);
+                explicitJobs = true;
+            } else if (0 == strcasecmp(argv[i] + 1, "snapshot")) {
+                snapshot = true;
+            } else if (0 == strcasecmp(argv[i] + 1, "shared")) {
+                sharedLib = true;
+            } else if (0 == strcasecmp(argv[i] + 1, "longest")) {
+                longestFirst = true;
+            } else if (0 == strcasecmp(argv[i] + 1, "switch")) {
+                switchConfigs.push_back("Debug");
+            } else if (0 == strncasecmp(argv[i] + 1, "switch=", 7)) {
+                std::string configs = argv[i] + 8;
+                size_t pos = 0;
+                while (pos <= configs.length()) {
+                    size_t next = configs.find(',', pos);
+                    if (next == std::string::npos) {
+                        next = configs.length();
+                    }
+                    if (next > pos) {
+                        switchConfigs.push_back(configs.substr(pos, next - pos));
+                    }
+                    pos = next + 1;
+                }
+            } else if (0 == strcasecmp(argv[i] + 1, "r")) {
+                recursive = true;
             } else if (0 == strcasecmp(argv[i] + 1, "project")) {
                 if (i + 1 < argc) {
                     projName = argv[++i];
                 }
+            } else if (0 == strcasecmp(argv[i] + 1, "workspace")) {
+                if (i + 1 < argc) {
+                    workspaceName = argv[++i];
+                }
             } else if (ELogLevel::ParseLogLevel(argv[i] + 1)) {
 
             } else if (0 == strcasecmp(argv[i] + 1, "stat")) {
-                unifier._stats = true;
+                stats = true;
             }
         } else {
             srcdir = argv[i];
@@ -93,30 +319,69 @@ int main(const int argc, const char * argv[]) {
     }
 
     if (ELogLevel::GetLogLevel() >= ELogLevel::INFO) {
-        unifier._stats = true;
+        stats = true;
     }
 
     if (srcdir == NULL) {
         srcdir = cwd;
     }
-    std::vector<std::string> projects;
+    shared::Path path(cwd, srcdir);
+    ProjectList list;
     if (projName) {
-        projects.push_back(projName);
+        list.add(path.string(), projName);
     }
-    shared::Path path(cwd, srcdir);
-    if (projects.empty()) {
+    if (workspaceName) {
+        std::string workspace = workspaceName;
+        if (!isEndOf(workspace, ".xcworkspace")) {
+            workspace.append(".xcworkspace");
+        }
+        findWorkspaceProjects(shared::Path(path.c_str(), workspace.c_str()).c_str(), list);
+    }
+    if (recursive) {
+        findProjectsRecursive(path.c_str(), list);
+    }
+    if (list.projects.empty() && !projName && !workspaceName) {
+        std::vector<std::string> projects;
         findProjects(path.c_str(), projects);
+        for (auto iter = projects.begin(); iter != projects.end(); ++iter) {
+            list.add(path.string(), *iter);
+        }
     }
-    size_t count = 0;
-    for (auto iter = projects.begin(); iter != projects.end(); ++iter) {
-        std::string proj_name = *iter;
-        std::string xcodeproj = ".xcodeproj";
-        if (!isEndOf(proj_name, xcodeproj)) {
-            proj_name.append(xcodeproj);
+
+    // one unifier per project, projects run in parallel and targets of a single project run in parallel
+    const auto& projects = list.projects;
+    std::vector<char> results(projects.size(), 0);
+    // output of each project is kept and printed in project order
+    const bool buffered = projects.size() > 1;
+    std::vector<LogBuffer> outputs(buffered ? projects.size() : 0);
+    shared::ParallelFor(projects.size(), jobs, [&](size_t i) {
+        if (buffered) {
+            ELogLevel::SetThreadBuffer(&outputs[i]);
         }
+        XcodeProjUnifier unifier;
+        unifier._unified = unified;
+        unifier._stats = stats;
+        unifier._snapshot = snapshot;
+        unifier._sharedLib = sharedLib;
+        unifier._switchConfigs = switchConfigs;
+        unifier._longestFirst = longestFirst;
+        unifier._jobs = projects.size() > 1 ? 1 : jobs;
+        unifier._parseJobs = explicitJobs ? unifier._jobs : 1;
+        results[i] = unifier.makeXcodeproj(projects[i].dir.c_str(), projects[i].name.c_str());
+        ELogLevel::SetThreadBuffer(NULL);
+    });
 
-        if (unifier.makeXcodeproj(path.c_str(), proj_name.c_str())) {
+    size_t count = 0;
+    for (size_t i = 0; i < projects.size(); ++i) {
+        shared::Path proj(projects[i].dir.c_str(), projects[i].name.c_str());
+        if (buffered) {
+            outputs[i].flush();
+        }
+        if (results[i]) {
             ++count;
+            LOG_I("Built %s\n", proj.c_str());
+        } else {
+            LOG_E("Build %s failed!\n", proj.c_str());
         }
     }
     if (!count) {
@@ -19,6 +19,7 @@
 // SOFTWARE.
 
 #include "NeXTSTEP_plist.hpp"
+#include "shared/SSources.h"
 
 namespace NeXTSTEP {
     struct SingleToken {
@@ -38,7 +39,16 @@ namespace NeXTSTEP {
     };
     static const size_t kSingleTokenCount = sizeof(kSingleTokens) / sizeof(SingleToken);
 
-    InlineTokenParser::InlineTokenParser(char* data) : _data(data), _current(data), _lineBegin(data), _line(0) {
+    // parse errors go to the log of the thread, buffered per project
+    static void logUnexpected(const char* expect, const Token& token) {
+        if (expect) {
+            LOG_E("Expect %s but get %s: %d(%d): |%s|\n", expect, TokenType::ToName(token.type), (int)token.line, (int)token.column, token.begin);
+        } else {
+            LOG_E("Unexpected token %s: %d(%d): |%s|\n", TokenType::ToName(token.type), (int)token.line, (int)token.column, token.begin);
+        }
+    }
+
+    InlineTokenParser::InlineTokenParser(char* data, const TextRanges* skips) : _data(data), _current(data), _lineBegin(data), _line(0), _skips(skips), _nextSkip(0) {
         _cachedNextToken.type = TokenType::None;
     }
 
@@ -88,6 +98,11 @@ namespace NeXTSTEP {
         }
 
         while (true) {
+            if (_skips && _nextSkip < _skips->size() && _current == (*_skips)[_nextSkip].first) {
+                _current = (*_skips)[_nextSkip++].second;
+                _lineBegin = _current;
+                continue;
+            }
             char ch = *_current;
             if (ch == ' ' || ch == '\t' || ch == '\r') {
 
@@ -220,12 +235,79 @@ namespace NeXTSTEP {
         if (token.type == type) {
             return true;
         }
-        printf("!!!!Expect %s but get :", TokenType::ToName(type));
-        token.dump();
+        logUnexpected(TokenType::ToName(type), token);
         return false;
     }
 
 
+    static const size_t kArenaBlockSize = 256 * 1024;
+    // allocations are prefixed by a header telling arena from heap
+    static const size_t kArenaHeader = 16;
+    static thread_local NodeArena* g_currentArena = NULL;
+
+    void* NodeArena::allocate(size_t size) {
+        size = (size + kArenaHeader - 1) & ~(kArenaHeader - 1);
+        if (size > (size_t)(_end - _current)) {
+            if (size > kArenaBlockSize / 4) {
+                // large one in its own block
+                char* block = (char*)malloc(size);
+                _blocks.push_back(block);
+                return block;
+            }
+            _current = (char*)malloc(kArenaBlockSize);
+            _end = _current + kArenaBlockSize;
+            _blocks.push_back(_current);
+        }
+        void* p = _current;
+        _current += size;
+        return p;
+    }
+
+    void NodeArena::reset() {
+        for (auto iter = _blocks.begin(); iter != _blocks.end(); ++iter) {
+            free(*iter);
+        }
+        _blocks.clear();
+        _current = NULL;
+        _end = NULL;
+    }
+
+    void NodeArena::adopt(NodeArena& other) {
+        _blocks.insert(_blocks.end(), other._blocks.begin(), other._blocks.end());
+        other._blocks.clear();
+        other._current = NULL;
+        other._end = NULL;
+    }
+
+    NodeArena::Scope::Scope(NodeArena* arena) : _prev(g_currentArena) {
+        g_currentArena = arena;
+    }
+
+    NodeArena::Scope::~Scope() {
+        g_currentArena = _prev;
+    }
+
+    void* NodeArena::New(size_t size) {
+        char* p;
+        if (g_currentArena) {
+            p = (char*)g_currentArena->allocate(size + kArenaHeader);
+            p[0] = 1;
+        } else {
+            p = (char*)malloc(size + kArenaHeader);
+            p[0] = 0;
+        }
+        return p + kArenaHeader;
+    }
+
+    void NodeArena::Delete(void* p) {
+        if (p) {
+            char* header = (char*)p - kArenaHeader;
+            if (!header[0]) {
+                free(header);
+            }
+        }
+    }
+
     Value::~Value() {
         clear();
     }
@@ -330,6 +412,35 @@ namespace NeXTSTEP {
         return v;
     }
 
+    Value Value::NewCopy(const Value& other) {
+        switch (other._vt) {
+            case ValueType::String:
+            case ValueType::SharedString:
+                return NewString(other._value._string);
+
+            case ValueType::Array: {
+                Array* array = new Array();
+                array->reserve(other._value._array->size());
+                for (auto iter = other._value._array->begin(); iter != other._value._array->end(); ++iter) {
+                    array->push_back(NewCopy(*iter));
+                }
+                return NewArray(array);
+            }
+
+            case ValueType::Object: {
+                Object* object = new Object();
+                object->reserve(other._value._object->size());
+                for (auto iter = other._value._object->begin(); iter != other._value._object->end(); ++iter) {
+                    object->push_back(new KeyValue((*iter)->key.c_str(), NewCopy((*iter)->value)));
+                }
+                return NewObject(object);
+            }
+
+            default:
+                return Value();
+        }
+    }
+
     bool Value::parse(InlineTokenParser& parser) {
         Token token;
 
@@ -352,8 +463,7 @@ namespace NeXTSTEP {
                     return _value._array->parse(parser);
                 }
                 default: {
-                    printf("!!!Error unexpected token: ");
-                    token.dump();
+                    logUnexpected(NULL, token);
                     return false;
                 }
             }
@@ -380,6 +490,42 @@ namespace NeXTSTEP {
         }
     }
 
+    static bool matchString(const char*& text, const char* str) {
+        const size_t length = strlen(str);
+        if (strncmp(text, str, length) != 0) {
+            return false;
+        }
+        text += length;
+        return true;
+    }
+
+    static bool matchIndent(const char*& text, int32_t indent) {
+        for (int32_t i = 0; i < indent; ++i) {
+            if (*text != '\t') {
+                return false;
+            }
+            ++text;
+        }
+        return true;
+    }
+
+    bool Value::matches(int32_t indent, const char*& text) const {
+        switch (_vt) {
+            case ValueType::String:
+            case ValueType::SharedString:
+                return matchString(text, _value._string);
+
+            case ValueType::Array:
+                return _value._array->matches(indent, text);
+
+            case ValueType::Object:
+                return _value._object->matches(indent, text);
+
+            default:
+                return true;
+        }
+    }
+
     void KeyValue::write(int32_t indent, shared::StrBuf& buf) const {
         if (isComment()) {
             value.write(0, buf);
@@ -421,8 +567,7 @@ namespace NeXTSTEP {
                     break;
                 }
                 default: {
-                    printf("!!!Error unexpected token: ");
-                    token.dump();
+                    logUnexpected(NULL, token);
                     return false;
                 }
             }
@@ -455,6 +600,20 @@ namespace NeXTSTEP {
         buf.append(')');
     }
 
+    bool Array::matches(int32_t indent, const char*& text) const {
+        if (!matchString(text, indent >= 0 ? "(\n" : "(")) {
+            return false;
+        }
+        int32_t childIndent = indent < 0 ? indent : indent + 1;
+        for (auto iter = begin(); iter != end(); ++iter) {
+            if (!matchIndent(text, childIndent) || !iter->matches(childIndent, text) ||
+                !matchString(text, childIndent < 0 ? ", " : ",\n")) {
+                return false;
+            }
+        }
+        return matchIndent(text, indent) && matchString(text, ")");
+    }
+
     Object::~Object() {
         for (auto iter = begin(); iter != end(); ++iter) {
             delete *iter;
@@ -462,25 +621,40 @@ namespace NeXTSTEP {
     }
 
     bool Object::parse(InlineTokenParser& parser) {
+        return parse(parser, TokenType::ObjectEnd);
+    }
+
+    bool Object::parseItems(InlineTokenParser& parser) {
+        return parse(parser, TokenType::None);
+    }
+
+    bool Object::parse(InlineTokenParser& parser, TokenType::Enum endType) {
         Token token;
         while (true) {
             parser.parseNext(token);
+            if (token.type == endType) {
+                return true;
+            }
             switch (token.type) {
-                case TokenType::ObjectEnd: {
-                    return true;
-                }
                 case TokenType::Token: {
                     KeyValue* kv = new KeyValue();
                     kv->key = token.begin;
+                    kv->sourceBegin = token.begin;
                     if (!parser.expectToken(TokenType::ValuePrompt)) {
+                        delete kv;
                         return false;
                     }
                     if (!kv->value.parse(parser)) {
+                        delete kv;
                         return false;
                     }
-                    if (!parser.expectToken(TokenType::ObjectSeparator)) {
+                    parser.parseNext(token);
+                    if (token.type != TokenType::ObjectSeparator) {
+                        logUnexpected(TokenType::ToName(TokenType::ObjectSeparator), token);
+                        delete kv;
                         return false;
                     }
+                    kv->sourceEnd = token.begin;
                     push_back(kv);
                     break;
                 }
@@ -489,8 +663,7 @@ namespace NeXTSTEP {
                     break;
                 }
                 default: {
-                    printf("!!!Error unexpected token: ");
-                    token.dump();
+                    logUnexpected(NULL, token);
                     return false;
                 }
             }
@@ -528,6 +701,26 @@ namespace NeXTSTEP {
         buf.append('}');
     }
 
+    bool Object::matches(int32_t indent, const char*& text) const {
+        if (!matchString(text, indent >= 0 ? "{\n" : "{")) {
+            return false;
+        }
+        int32_t childIndent = indent < 0 ? indent : indent + 1;
+        for (auto iter = begin(); iter != end(); ++iter) {
+            if ((*iter)->isComment()) {
+                if (!(*iter)->value.matches(0, text) || (childIndent >= 0 && !matchString(text, "\n"))) {
+                    return false;
+                }
+            } else {
+                if (!matchIndent(text, childIndent) || !matchString(text, (*iter)->key.c_str()) || !matchString(text, " = ") ||
+                    !(*iter)->value.matches(childIndent, text) || !matchString(text, childIndent < 0 ? "; " : ";\n")) {
+                    return false;
+                }
+            }
+        }
+        return matchIndent(text, indent) && matchString(text, "}");
+    }
+
     const Value* Object::valueByKey(const char* key) const {
         if (!key || !key[0]) {
             return NULL;
@@ -595,6 +788,7 @@ namespace NeXTSTEP {
         }
         for (auto iter = begin(); iter != end(); ++iter) {
             if ((*iter)->key.compare(key) == 0) {
+                delete *iter;
                 erase(iter);
                 return true;
             }
@@ -602,11 +796,13 @@ namespace NeXTSTEP {
         return false;
     }
 
-    bool PList::inlineParse(char* data) {
+    bool PList::inlineParse(char* data, const TextRanges* skips) {
         _data = data;
         clear();
+        _arena.reset();
+        NodeArena::Scope scope(&_arena);
 
-        InlineTokenParser parser(data);
+        InlineTokenParser parser(data, skips);
         if (!parser.expectToken(TokenType::Comment)) {
             return false;
         }
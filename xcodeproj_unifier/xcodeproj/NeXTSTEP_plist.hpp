@@ -74,8 +74,11 @@ namespace NeXTSTEP {
         }
     };
 
+    // [begin, end) ranges of text
+    typedef std::vector<std::pair<char*, char*> > TextRanges;
+
     struct InlineTokenParser {
-        explicit InlineTokenParser(char* data);
+        explicit InlineTokenParser(char* data, const TextRanges* skips = NULL);
         void parseNext(Token& token);
         bool expectToken(TokenType::Enum type);
 
@@ -90,8 +93,54 @@ namespace NeXTSTEP {
         char* _lineBegin;
         size_t _line;
         Token _cachedNextToken;
+        // sorted ranges jumped over between tokens
+        const TextRanges* _skips;
+        size_t _nextSkip;
+    };
+
+    // Bump allocator for the nodes of a parsed document, so nodes are laid out
+    // in parse order in a few large blocks. Memory of arena nodes is released
+    // with the arena, nodes created outside of a Scope come from the heap.
+    class NodeArena {
+    public:
+        NodeArena() : _current(NULL), _end(NULL) {
+        }
+        ~NodeArena() {
+            reset();
+        }
+
+        void* allocate(size_t size);
+        // free all blocks, no node allocated from the arena may be alive
+        void reset();
+        // take over the blocks of other
+        void adopt(NodeArena& other);
+
+        // nodes created with new on this thread come from arena while the scope lives
+        class Scope {
+        public:
+            explicit Scope(NodeArena* arena);
+            ~Scope();
+
+        private:
+            NodeArena* _prev;
+        };
+
+        static void* New(size_t size);
+        static void Delete(void* p);
+
+    private:
+        std::vector<char*> _blocks;
+        char* _current;
+        char* _end;
+
+        NodeArena(const NodeArena& other) = delete;
+        NodeArena& operator=(const NodeArena& other) = delete;
     };
 
+#define NeXTSTEP_ARENA_NODE() \
+        static void* operator new(size_t size) { return NodeArena::New(size); } \
+        static void operator delete(void* p) { NodeArena::Delete(p); }
+
     enum class ValueType {
         None,
         String,
@@ -146,9 +195,13 @@ namespace NeXTSTEP {
         static Value NewString(const char* string);
         static Value NewArray(Array* array);
         static Value NewObject(Object* object);
+        // deep copy, strings are copied too
+        static Value NewCopy(const Value& other);
 
         bool parse(InlineTokenParser& parser);
         void write(int32_t indent, shared::StrBuf& buf) const;
+        // true when text begins with the output of write(indent), text is moved past it
+        bool matches(int32_t indent, const char*& text) const;
 
     protected:
         ValueType _vt;
@@ -166,23 +219,29 @@ namespace NeXTSTEP {
     };
 
     struct KeyValue {
+        NeXTSTEP_ARENA_NODE()
+
         std::string key;
         Value value;
+        // parsed text of the item in the source data, from the key to the ';',
+        // NULL for comments and created items
+        const char* sourceBegin;
+        const char* sourceEnd;
 
-        KeyValue() {
+        KeyValue() : sourceBegin(NULL), sourceEnd(NULL) {
         }
 
-        KeyValue(const char* key_, Value&& value_) : key(key_), value(std::move(value_)) {
+        KeyValue(const char* key_, Value&& value_) : key(key_), value(std::move(value_)), sourceBegin(NULL), sourceEnd(NULL) {
         }
 
-        KeyValue(const char* key_, Object* value_) : key(key_), value(Value::NewObject(value_)) {
+        KeyValue(const char* key_, Object* value_) : key(key_), value(Value::NewObject(value_)), sourceBegin(NULL), sourceEnd(NULL) {
         }
 
         bool isComment() const {
             return key.empty();
         }
 
-        KeyValue(KeyValue&& other) {
+        KeyValue(KeyValue&& other) : sourceBegin(NULL), sourceEnd(NULL) {
             swap(other);
         }
         void operator=(KeyValue&& other) {
@@ -192,6 +251,8 @@ namespace NeXTSTEP {
         void swap(KeyValue& other) {
             std::swap(key, other.key);
             std::swap(value, other.value);
+            std::swap(sourceBegin, other.sourceBegin);
+            std::swap(sourceEnd, other.sourceEnd);
         }
         void write(int32_t indent, shared::StrBuf& buf) const;
 
@@ -206,15 +267,29 @@ namespace NeXTSTEP {
 
     struct Array : std::vector<Value> {
     public:
+        NeXTSTEP_ARENA_NODE()
+
         bool parse(InlineTokenParser& parser);
         void write(int32_t indent, shared::StrBuf& buf) const;
+        bool matches(int32_t indent, const char*& text) const;
     };
 
     struct Object : std::vector<KeyValue*> {
     public:
+        NeXTSTEP_ARENA_NODE()
+
+        // kind of the object set by the document, 0 when unknown
+        uint32_t tag;
+
+        Object() : tag(0) {
+        }
+
         ~Object();
         bool parse(InlineTokenParser& parser);
+        // parse key/value items up to the end of data
+        bool parseItems(InlineTokenParser& parser);
         void write(int32_t indent, shared::StrBuf& buf) const;
+        bool matches(int32_t indent, const char*& text) const;
         const Value* valueByKey(const char* key) const;
         const char* stringByKey(const char* key) const;
         Array* arrayByKey(const char* key) const;
@@ -224,16 +299,32 @@ namespace NeXTSTEP {
         bool set(const char* key, Array* array);
         bool set(const char* key, Object* object);
         bool remove(const char* key);
+
+    private:
+        bool parse(InlineTokenParser& parser, TokenType::Enum endType);
     };
 
     class PList : public Value {
     public:
         PList() {}
+        ~PList() {
+            clear();
+        }
 
-        bool inlineParse(char* data);
+        NodeArena& arena() {
+            return _arena;
+        }
+
+        bool inlineParse(char* data, const TextRanges* skips = NULL);
+        // set the root without parsing, strings of root are not owned
+        void assign(Value&& root, char* data) {
+            Value::operator=(std::move(root));
+            _data = data;
+        }
 
     protected:
         char* _data;
+        NodeArena _arena;
     };
 }
 
@@ -19,6 +19,7 @@
 // SOFTWARE.
 
 #include "namehash.h"
+#include <string.h>
 
 static unsigned char gethashchar(char c) {
     unsigned char uc = c;
@@ -44,3 +45,46 @@ uint32_t HashString(const char* str, uint32_t seed) {
     }
     return hash;
 }
+
+static const uint64_t kTableHashMul = 0x9E3779B97F4A7C15ULL;
+static const uint64_t kOnes = 0x0101010101010101ULL;
+
+// 'A'-'Z' bytes of word to lower case, other bytes are kept
+static uint64_t lowerWord(uint64_t word) {
+    const uint64_t heptets = word & (0x7F * kOnes);
+    const uint64_t aboveA = heptets + (0x80 - 'A') * kOnes;
+    const uint64_t aboveZ = heptets + (0x80 - 'Z' - 1) * kOnes;
+    const uint64_t upper = aboveA & ~aboveZ & ~word & (0x80 * kOnes);
+    return word | (upper >> 2);
+}
+
+static uint64_t mixWord(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * kTableHashMul;
+    return hash ^ (hash >> 29);
+}
+
+static size_t tableHash(const char* str, bool ignoreCase) {
+    const size_t length = strlen(str);
+    uint64_t hash = length * kTableHashMul;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, str + i, 8);
+        hash = mixWord(hash, ignoreCase ? lowerWord(word) : word);
+    }
+    if (i < length) {
+        uint64_t word = 0;
+        memcpy(&word, str + i, length - i);
+        hash = mixWord(hash, ignoreCase ? lowerWord(word) : word);
+    }
+    hash ^= hash >> 32;
+    return (size_t)(hash * kTableHashMul);
+}
+
+size_t TableHashString(const char* str) {
+    return tableHash(str, false);
+}
+
+size_t TableHashPath(const char* path) {
+    return tableHash(path, true);
+}
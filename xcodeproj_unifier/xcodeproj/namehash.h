@@ -22,7 +22,12 @@
 #define namehash_h__
 #include <string>
 
+// stable hashes, generated object ids are made of them
 uint32_t HashPath(const char* path, uint32_t seed);
 uint32_t HashString(const char* str, uint32_t seed);
+// word at a time hashes for in memory tables only, not stable across versions,
+// the path one ignores ascii case like HashPath
+size_t TableHashString(const char* str);
+size_t TableHashPath(const char* path);
 
 #endif//namehash_h__
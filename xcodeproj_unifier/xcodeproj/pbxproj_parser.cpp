@@ -21,8 +21,12 @@
 #include "pbxproj_parser.hpp"
 #include <shared/utils/Path.h>
 #include <unordered_set>
+#include <algorithm>
 #include <shared/SharedMacros.h>
 #include "shared/file_utils.h"
+#include "shared/SSources.h"
+#include <shared/utils/ParallelFor.h>
+#include <deque>
 
 #define PROJ_VisitAllKnownNode 1
 #define PROJ_WarnUnknownNode 1
@@ -65,23 +69,81 @@ namespace pbxproj {
         { "PBXLegacyTarget", true },
         { "PBXNativeTarget", true },
     };
-    static const SectionInfo* sectionInfo(const char* section) {
-        static std::unordered_map<const char*, const SectionInfo*, hash_c_str, equal_to_c_str> g_infos;
-        if (!g_infos.size()) {
-            for (size_t i = 0; i < _countof(kKnownSections); ++i) {
-                g_infos.insert({kKnownSections[i].name, kKnownSections + i});
+    // kKnownSections[i] is of IsaType kFirstKnownIsa + i
+    static const int32_t kFirstKnownIsa = IsaType::PBXBuildFile;
+    static_assert(_countof(kKnownSections) == IsaType::Count - kFirstKnownIsa, "kKnownSections and IsaType mismatch");
+
+    static bool sectionBreakline(IsaType::Enum isa) {
+        return isa < kFirstKnownIsa || isa >= IsaType::Count || kKnownSections[isa - kFirstKnownIsa].breakline;
+    }
+
+    IsaType::Enum IsaType::FromString(const char* src) {
+        if (!src) {
+            return None;
+        }
+        // linear lookup, no lazy static so that projects can be parsed from multiple threads
+        for (size_t i = 0; i < _countof(kKnownSections); ++i) {
+            if (strcmp(kKnownSections[i].name, src) == 0) {
+                return (Enum)(kFirstKnownIsa + i);
             }
         }
-        const auto iter = g_infos.find(section);
-        if (iter == g_infos.end()) {
-            return NULL;
+        return Unknown;
+    }
+
+    const char* IsaType::ToString(Enum src) {
+        if (src >= kFirstKnownIsa && src < Count) {
+            return kKnownSections[src - kFirstKnownIsa].name;
         }
-        return iter->second;
+        return NULL;
+    }
+
+    IsaType::Enum IsaType::Of(const NeXTSTEP::Object* obj) {
+        if (obj->tag) {
+            return (Enum)obj->tag;
+        }
+        return FromString(obj->stringByKey("isa"));
     }
 
-    static bool sectionBreakline(const char* section) {
-        const auto info = sectionInfo(section);
-        return !info || info->breakline;
+    // hex digit value of each char, kHexInvalid for the others
+    static const uint8_t kHexInvalid = 0x10;
+    struct HexDigitTable {
+        HexDigitTable() {
+            memset(value, kHexInvalid, sizeof(value));
+            for (uint8_t i = 0; i < 10; ++i) {
+                value['0' + i] = i;
+            }
+            for (uint8_t i = 0; i < 6; ++i) {
+                value['A' + i] = value['a' + i] = 10 + i;
+            }
+        }
+        uint8_t value[256];
+    };
+    static const HexDigitTable kHexDigits;
+
+    bool SId::fromString(const char* str) {
+        for (size_t i = 0; i < 3; ++i) {
+            uint32_t id = 0;
+            for (size_t j = 0; j < 8; ++j) {
+                const uint8_t digit = kHexDigits.value[(uint8_t)*(str++)];
+                if (digit == kHexInvalid) {
+                    return false;
+                }
+                id = (id << 4) | digit;
+            }
+            _id[i] = id;
+        }
+        return true;
+    }
+
+    void SId::toString(char* out) const {
+        static const char kDigits[] = "0123456789ABCDEF";
+        for (size_t i = 0; i < 3; ++i) {
+            const uint32_t id = _id[i];
+            for (int32_t shift = 28; shift >= 0; shift -= 4) {
+                *(out++) = kDigits[(id >> shift) & 0xF];
+            }
+        }
+        *out = 0;
     }
 
     static const std::string kBegin = "/* Begin ";
@@ -146,8 +208,11 @@ namespace pbxproj {
         this->key = key;
         isFile = file;
 
-        if (path) {
+        // most paths carry no quotes or escapes, use them in place
+        const char* name = path;
+        if (path && strpbrk(path, "\"\\")) {
             pathFromSourceTree = unescape(path);
+            name = pathFromSourceTree.c_str();
 #if 0
             std::string un = escape(pathFromSourceTree.c_str());
             if (strcmp(pathFromSourceTree.c_str(), path) != 0) {
@@ -159,16 +224,30 @@ namespace pbxproj {
             }
 #endif
         }
-        if (sourceTree == SourceTreeType::Group) {
-            if (parent) {
-                sourceTree = parent->sourceTree;
-                if (path) {
-                    shared::Path full(parent->pathFromSourceTree.c_str(), pathFromSourceTree.c_str());
-                    pathFromSourceTree = full.c_str();
+        if (sourceTree == SourceTreeType::Group && parent) {
+            sourceTree = parent->sourceTree;
+            if (path) {
+                // same as shared::Path(parent, name) but built in place,
+                // the parent path is already final so it is only appended
+                std::string full;
+                if (shared::Path::is_absolute(name)) {
+                    full = name;
                 } else {
-                    pathFromSourceTree = parent->pathFromSourceTree;
+                    const std::string& dir = parent->pathFromSourceTree;
+                    full.reserve(dir.length() + 1 + strlen(name));
+                    full = dir;
+                    if (full.length() && full.back() != '/') {
+                        full.push_back('/');
+                    }
+                    full.append(name);
                 }
+                full.resize(shared::Path::normalize(&full[0]));
+                pathFromSourceTree.swap(full);
+            } else {
+                pathFromSourceTree = parent->pathFromSourceTree;
             }
+        } else if (path && name == path) {
+            pathFromSourceTree = path;
         }
     }
 
@@ -232,14 +311,244 @@ namespace pbxproj {
         return path;
     }
 
-    Project::Project() : _project(NULL), _objects(NULL) {
+    void SectionItems::indexLast(size_t run) {
+        const char* last = _runs[run].rbegin()->first;
+        if (!_byLast.empty() && strcmp(_byLast.rbegin()->first, last) >= 0) {
+            return;
+        }
+        if (!_byLast.empty() && _byLast.rbegin()->second == run) {
+            _byLast.erase(std::prev(_byLast.end()));
+        }
+        _byLast.insert(_byLast.end(), {last, run});
+    }
+
+    void SectionItems::buildIndex() {
+        _byLast.clear();
+        for (size_t i = 0; i < _runs.size(); ++i) {
+            if (!_runs[i].empty()) {
+                indexLast(i);
+            }
+        }
+        _indexed = true;
+    }
+
+    size_t SectionItems::findRun(const char* key) {
+        if (!_indexed) {
+            buildIndex();
+        }
+        auto iter = _byLast.lower_bound(key);
+        return iter == _byLast.end() ? _runs.size() : iter->second;
+    }
+
+    void SectionItems::push_back(NeXTSTEP::KeyValue* kv) {
+        const char* key = kv->key.c_str();
+        if (_runs.empty() || (!_runs.back().empty() && strcmp(_runs.back().rbegin()->first, key) >= 0)) {
+            _runs.push_back(Run());
+        }
+        Run& run = _runs.back();
+        run.insert(run.end(), {key, kv});
+        ++_size;
+        if (_indexed) {
+            indexLast(_runs.size() - 1);
+        }
     }
 
-    bool Project::inlineParse(char* src) {
+    void SectionItems::insert(NeXTSTEP::KeyValue* kv) {
+        const char* key = kv->key.c_str();
+        const size_t index = findRun(key);
+        if (index < _runs.size()) {
+            auto iter = _runs.begin() + index;
+            Run& run = *iter;
+            auto pos = run.lower_bound(key);
+            if (strcmp(pos->first, key) == 0) {
+                // same key, split the run to keep the new item in front of the old one
+                Run tail(pos, run.end());
+                run.erase(pos, run.end());
+                Run item;
+                item.insert({key, kv});
+                iter = _runs.insert(iter + 1, std::move(item));
+                _runs.insert(iter + 1, std::move(tail));
+                _indexed = false;
+            } else {
+                run.insert(pos, {key, kv});
+            }
+            ++_size;
+            return;
+        }
+        if (_runs.empty()) {
+            _runs.push_back(Run());
+        }
+        Run& run = _runs.back();
+        run.insert(run.end(), {key, kv});
+        ++_size;
+        if (_indexed) {
+            indexLast(_runs.size() - 1);
+        }
+    }
+
+    bool SectionItems::erase(const char* key) {
+        // runs before the found one end before key, later ones may overlap it
+        for (size_t i = findRun(key); i < _runs.size(); ++i) {
+            Run& run = _runs[i];
+            auto pos = run.find(key);
+            if (pos != run.end()) {
+                if (std::next(pos) == run.end()) {
+                    _indexed = false;
+                }
+                run.erase(pos);
+                --_size;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Project::Project() : _source(NULL), _sourceLength(0), _sourceData(NULL), _project(NULL), _objects(NULL), _objectsSorted(true), _modified(false) {
+        clearIndex();
+    }
+
+    bool Project::inlineParse(char* src, size_t jobs, const char* original) {
+        _sourceLength = strlen(src);
+        if (original) {
+            _sourceCopy.clear();
+            _source = original;
+        } else {
+            _sourceCopy.assign(src, _sourceLength);
+            _source = _sourceCopy.c_str();
+        }
+        _sourceData = src;
+        _touched.clear();
+        _modified = false;
+        if (jobs != 1 && _sourceLength >= kShardMinSize) {
+            if (inlineParseSharded(src, jobs)) {
+                return buildIndex(true);
+            }
+            // restore the text changed by the failed try
+            memcpy(src, _source, _sourceLength);
+        }
         if (!_plist.inlineParse(src) || !_plist.isObject()) {
             return false;
         }
+        return buildIndex(true);
+    }
+
+    // Section bodies of objects are cut into chunks at item boundaries and
+    // parsed in parallel, the rest is parsed skipping the bodies, then the
+    // items are put back between the begin and end comments of their sections.
+    bool Project::inlineParseSharded(char* src, size_t jobs) {
+        struct Chunk {
+            char* begin;
+            char* end;
+            size_t section;
+            // declared before items, so it is freed after them
+            NeXTSTEP::NodeArena arena;
+            NeXTSTEP::Object items;
+            bool ok;
+        };
+
+        // pre-scan: bodies between "\n/* Begin X section */\n" and "\n/* End X section */\n"
+        NeXTSTEP::TextRanges bodies;
+        const std::string beginLine = "\n" + kBegin;
+        char* p = src;
+        while ((p = strstr(p, beginLine.c_str())) != NULL) {
+            char* type = p + beginLine.length();
+            char* lineEnd = strchr(type, '\n');
+            if (!lineEnd || (size_t)(lineEnd - type) <= kSection.length() ||
+                memcmp(lineEnd - kSection.length(), kSection.c_str(), kSection.length()) != 0) {
+                return false;
+            }
+            std::string endLine = "\n" + kEnd + std::string(type, lineEnd - kSection.length() - type) + kSection + "\n";
+            char* found = strstr(lineEnd, endLine.c_str());
+            if (!found) {
+                return false;
+            }
+            bodies.push_back({lineEnd + 1, found + 1});
+            p = found + 1;
+        }
+        if (bodies.size() < 2) {
+            return false;
+        }
 
+        // chunks end at a line starting an item: two tabs then a key
+        std::deque<Chunk> chunks;
+        for (size_t i = 0; i < bodies.size(); ++i) {
+            char* begin = bodies[i].first;
+            char* end = bodies[i].second;
+            while (begin < end) {
+                char* chunkEnd = end;
+                for (char* q = begin + kShardChunkSize; q + 4 < end; ++q) {
+                    q = (char*)memchr(q, '\n', end - q);
+                    if (!q || q + 4 >= end) {
+                        break;
+                    }
+                    if (q[1] == '\t' && q[2] == '\t' && q[3] != '\t' && q[3] != '}' && q[3] != ')') {
+                        chunkEnd = q + 1;
+                        break;
+                    }
+                }
+                chunks.emplace_back();
+                Chunk& chunk = chunks.back();
+                chunk.begin = begin;
+                chunk.end = chunkEnd;
+                chunk.section = i;
+                chunk.ok = false;
+                begin = chunkEnd;
+            }
+        }
+
+        // the '\n' ending each chunk terminates its text
+        for (auto iter = chunks.begin(); iter != chunks.end(); ++iter) {
+            iter->end[-1] = 0;
+        }
+        shared::ParallelFor(chunks.size(), jobs, [&](size_t i) {
+            Chunk& chunk = chunks[i];
+            NeXTSTEP::NodeArena::Scope scope(&chunk.arena);
+            NeXTSTEP::InlineTokenParser parser(chunk.begin);
+            chunk.ok = chunk.items.parseItems(parser);
+        });
+        for (auto iter = chunks.begin(); iter != chunks.end(); ++iter) {
+            if (!iter->ok) {
+                return false;
+            }
+        }
+
+        if (!_plist.inlineParse(src, &bodies) || !_plist.isObject()) {
+            return false;
+        }
+        NeXTSTEP::Object* objs = _plist.objectByKey("objects");
+        if (!objs || objs->size() != bodies.size() * 2) {
+            return false;
+        }
+        for (auto iter = objs->begin(); iter != objs->end(); ++iter) {
+            if (!(*iter)->isComment()) {
+                return false;
+            }
+        }
+
+        // stitch in the original order
+        NeXTSTEP::Object comments;
+        comments.swap(*objs);
+        size_t count = comments.size();
+        for (auto iter = chunks.begin(); iter != chunks.end(); ++iter) {
+            count += iter->items.size();
+        }
+        objs->reserve(count);
+        auto chunk = chunks.begin();
+        for (size_t i = 0; i < bodies.size(); ++i) {
+            objs->push_back(comments[i * 2]);
+            for (; chunk != chunks.end() && chunk->section == i; ++chunk) {
+                objs->insert(objs->end(), chunk->items.begin(), chunk->items.end());
+                chunk->items.clear();
+                _plist.arena().adopt(chunk->arena);
+            }
+            objs->push_back(comments[i * 2 + 1]);
+        }
+        comments.clear();
+        return true;
+    }
+
+    bool Project::buildIndex(bool verifySource, bool paths) {
+        clearIndex();
         NeXTSTEP::Object* objs = _plist.objectByKey("objects");
         if (!objs) {
             return false;
@@ -266,6 +575,8 @@ namespace pbxproj {
                         return false;
                     }
                     section.type = sectionType;
+                    section.isa = IsaType::FromString(sectionType.c_str());
+                    section.beginComment = *iter;
                 } else if (isBeginWith(comment, kEnd) && isEndWith(comment, kSection)) {
                     std::string sectionType(comment.c_str() + kEnd.length(), comment.length() - kEnd.length() - kSection.length());
                     assert(section.type.length() != 0);
@@ -273,6 +584,10 @@ namespace pbxproj {
                         return false;
                     }
                     if (section.type.length() != 0) {
+                        section.endComment = *iter;
+                        if (section.isa > IsaType::Unknown && _sectionByIsa[section.isa] < 0) {
+                            _sectionByIsa[section.isa] = (int32_t)_sections.size();
+                        }
                         _sections.push_back(std::move(section));
                         assert(section.type.length() == 0);
                         section.clear();
@@ -296,7 +611,26 @@ namespace pbxproj {
                     section.type = isa;
                     return false;
                 }
+                (*iter)->value.object()->tag = section.isa;
                 section.items.push_back(*iter);
+                _objectmap.insert({key.c_str(), *iter});
+
+                // keep the parsed text only when it is exactly what write() outputs
+                NeXTSTEP::KeyValue* kv = *iter;
+                if (verifySource && kv->sourceBegin) {
+                    const char* text = _source + (kv->sourceBegin - _sourceData);
+                    const int32_t indent = sectionBreakline(section.isa) ? 2 : -1;
+                    bool same = strncmp(text, key.c_str(), key.length()) == 0;
+                    if (same) {
+                        text += key.length();
+                        same = strncmp(text, " = ", 3) == 0;
+                        text += 3;
+                    }
+                    if (!same || !kv->value.matches(indent, text) || text != _source + (kv->sourceEnd - _sourceData)) {
+                        kv->sourceBegin = NULL;
+                        kv->sourceEnd = NULL;
+                    }
+                }
             } else {
                 return false;
             }
@@ -305,6 +639,9 @@ namespace pbxproj {
         if (section.type.length() != 0) {
             _sections.push_back(std::move(section));
         }
+        if (!paths) {
+            return true;
+        }
 
         struct BuildPathContext {
             Project* proj;
@@ -319,83 +656,109 @@ namespace pbxproj {
                 }
             }
 
+            struct GroupFrame {
+                GroupFrame(const NeXTSTEP::Object* obj, const char* key, const PBXPath* parent)
+                : group(obj, key, parent, false), children(obj->arrayByKey("children")), next(0) {
+                }
+                PBXPath group;
+                const NeXTSTEP::Array* children;
+                size_t next;
+            };
+
+            // groups nest as deep as the source tree, walk them with an
+            // explicit stack, a group is inserted after its children as before
+            void buildGroup(const PBXPath* parentGroup, const char* key, const NeXTSTEP::Object* obj) {
+                std::deque<GroupFrame> stack;
+                stack.emplace_back(obj, key, parentGroup);
+                while (!stack.empty()) {
+                    GroupFrame& frame = stack.back();
+                    if (!frame.children || frame.next >= frame.children->size()) {
+                        const char* groupKey = frame.group.key;
+                        assert(proj->_pathmap.find(groupKey) == proj->_pathmap.end());
+                        proj->insertPath(groupKey, std::move(frame.group));
+                        stack.pop_back();
+                        continue;
+                    }
+                    const NeXTSTEP::Value& child = (*frame.children)[frame.next++];
+                    if (!child.isString()) {
+                        continue;
+                    }
+                    const char* childKey = child.string();
+                    auto childObj = proj->object(childKey);
+                    if (childObj && IsaType::Of(childObj) == IsaType::PBXGroup) {
+                        stack.emplace_back(childObj, childKey, &frame.group);
+                    } else {
+                        build(&frame.group, childKey);
+                    }
+                }
+            }
+
             void build(const PBXPath* parentGroup, const char* key) {
                 if (!key) {
                     return;
                 }
-                auto obj = proj->_objects->objectByKey(key);
+                auto obj = proj->object(key);
                 if (!obj) {
                     return;
                 }
-                const char* isa = obj->stringByKey("isa");
-                if (!isa) {
-                    return;
-                }
-                if (strcmp(isa, "PBXProject") == 0) {
-                    proj->_project = obj;
-                    build(NULL, obj->stringByKey("mainGroup"));
-                    buildArray(NULL, obj->arrayByKey("targets"));
-
-                } else if (strcmp(isa, "PBXGroup") == 0) {
-                    PBXPath group(obj, key, parentGroup, false);
-                    buildArray(&group, obj->arrayByKey("children"));
-                    auto iter = proj->_pathmap.find(key);
-                    assert(iter == proj->_pathmap.end());
-                    proj->_pathmap.insert({key, std::move(group)});
-
-                } else if (strcmp(isa, "PBXFileReference") == 0) {
-                    auto iter = proj->_pathmap.find(key);
-                    if (!parentGroup) {
-                        assert(iter != proj->_pathmap.end());
-                        return;
-                    }
-                    assert(iter == proj->_pathmap.end());
-                    if (iter == proj->_pathmap.end()) {
-                        PBXPath file(obj, key, parentGroup, true);
-                        proj->_pathmap.insert({key, std::move(file)});
-                    }
+                switch (IsaType::Of(obj)) {
+                    case IsaType::None:
+                        break;
 
-                } else if (strcmp(isa, "PBXNativeTarget") == 0) {
-                    proj->_targets.push_back(obj);
-                    buildArray(NULL, obj->arrayByKey("buildPhases"));
+                    case IsaType::PBXProject:
+                        proj->_project = obj;
+                        build(NULL, obj->stringByKey("mainGroup"));
+                        buildArray(NULL, obj->arrayByKey("targets"));
+                        break;
 
-                } else if (strcmp(isa, "PBXSourcesBuildPhase") == 0) {
-                    buildArray(NULL, obj->arrayByKey("files"));
+                    case IsaType::PBXGroup:
+                        buildGroup(parentGroup, key, obj);
+                        break;
 
-                } else if (strcmp(isa, "PBXFrameworksBuildPhase") == 0) {
-#if PROJ_VisitAllKnownNode
-                    buildArray(NULL, obj->arrayByKey("files"));
-#endif//PROJ_VisitAllKnownNode
+                    case IsaType::PBXFileReference: {
+                        auto iter = proj->_pathmap.find(key);
+                        if (!parentGroup) {
+                            assert(iter != proj->_pathmap.end());
+                            return;
+                        }
+                        assert(iter == proj->_pathmap.end());
+                        if (iter == proj->_pathmap.end()) {
+                            proj->insertPath(key, PBXPath(obj, key, parentGroup, true));
+                        }
+                        break;
+                    }
 
-                } else if (strcmp(isa, "PBXHeadersBuildPhase") == 0) {
-#if PROJ_VisitAllKnownNode
-                    buildArray(NULL, obj->arrayByKey("files"));
-#endif//PROJ_VisitAllKnownNode
+                    case IsaType::PBXNativeTarget:
+                        proj->_targets.push_back(obj);
+                        buildArray(NULL, obj->arrayByKey("buildPhases"));
+                        break;
 
-                } else if (strcmp(isa, "PBXCopyFilesBuildPhase") == 0) {
-#if PROJ_VisitAllKnownNode
-                    buildArray(NULL, obj->arrayByKey("files"));
-#endif//PROJ_VisitAllKnownNode
+                    case IsaType::PBXSourcesBuildPhase:
+                        buildArray(NULL, obj->arrayByKey("files"));
+                        break;
 
-                } else if (strcmp(isa, "PBXResourcesBuildPhase") == 0) {
+                    case IsaType::PBXFrameworksBuildPhase:
+                    case IsaType::PBXHeadersBuildPhase:
+                    case IsaType::PBXCopyFilesBuildPhase:
+                    case IsaType::PBXResourcesBuildPhase:
+                    case IsaType::PBXShellScriptBuildPhase:
 #if PROJ_VisitAllKnownNode
-                    buildArray(NULL, obj->arrayByKey("files"));
+                        buildArray(NULL, obj->arrayByKey("files"));
 #endif//PROJ_VisitAllKnownNode
+                        break;
 
-                } else if (strcmp(isa, "PBXShellScriptBuildPhase") == 0) {
-#if PROJ_VisitAllKnownNode
-                    buildArray(NULL, obj->arrayByKey("files"));
-#endif//PROJ_VisitAllKnownNode
+                    case IsaType::PBXReferenceProxy:
+                        break;
 
-                } else if (strcmp(isa, "PBXReferenceProxy") == 0) {
+                    case IsaType::PBXBuildFile:
+                        build(NULL, obj->stringByKey("fileRef"));
+                        break;
 
-                } else if (strcmp(isa, "PBXBuildFile") == 0) {
-                    build(NULL, obj->stringByKey("fileRef"));
-                    
-                } else {
+                    default:
 #if PROJ_WarnUnknownNode
-                    printf("!!!!Error: Unknown %s type\n", isa);
+                        LOG_E("Unknown %s type\n", obj->stringByKey("isa"));
 #endif//PROJ_WarnUnknownNode
+                        break;
                 }
             }
         };
@@ -407,120 +770,883 @@ namespace pbxproj {
         return true;
     }
 
-    const PBXPath* Project::findGroupOrFilePath(NeXTSTEP::Object* obj) const {
-        const auto end_ = _pathmap.end();
-        for (auto iter = _pathmap.begin(); iter != end_; ++iter) {
-            if (iter->second.obj == obj) {
-                return &iter->second;
-            }
+    void Project::clearIndex() {
+        _sections.clear();
+        for (size_t i = 0; i < _countof(_sectionByIsa); ++i) {
+            _sectionByIsa[i] = -1;
         }
-        return NULL;
+        _project = NULL;
+        _objects = NULL;
+        _objectmap.clear();
+        _objectsSorted = true;
+        _targets.clear();
+        _pathByObject.clear();
+        _pathByFullpath.clear();
+        _pathByParent.clear();
+        _pathmap.clear();
     }
 
-    const PBXPath* Project::findGroupOrFilePath(const char* fullpath) const {
-        const auto end_ = _pathmap.end();
-        for (auto iter = _pathmap.begin(); iter != end_; ++iter) {
-            if (strcasecmp(iter->second.pathFromSourceTree.c_str(), fullpath) == 0) {
-                return &iter->second;
+    // Snapshot file: SnapshotHeader, string table, then the value tree as
+    // uint32 words: string (tag, string), array (tag, count, values), object
+    // (tag, count, [key string, source begin + 1, source end + 1, value]),
+    // then the path index in insertion order (count, [key string, parent
+    // key string + 1, path from source tree string, source tree, is file])
+    // and the targets (count, [key string]).
+    static const char kSnapshotMagic[8] = {'P', 'B', 'X', 'S', 'N', 'A', 'P', 0};
+    static const uint32_t kSnapshotVersion = 2;
+
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        uint64_t sourceHash;
+        uint64_t sourceLength;
+        uint64_t stringsSize;
+        uint64_t wordCount;
+        uint64_t payloadHash;
+    };
+
+    struct SnapshotTag {
+        enum Enum {
+            String = 1,
+            Array,
+            Object,
+        };
+    };
+
+    struct SnapshotWriter {
+        const char* sourceData;
+        std::string strings;
+        std::unordered_map<std::string, uint32_t> offsets;
+        std::vector<uint32_t> words;
+
+        uint32_t string(const char* str) {
+            auto iter = offsets.find(str);
+            if (iter != offsets.end()) {
+                return iter->second;
             }
+            uint32_t offset = (uint32_t)strings.length();
+            strings.append(str, strlen(str) + 1);
+            offsets.insert({str, offset});
+            return offset;
         }
-        return NULL;
-    }
 
+        uint32_t source(const char* p) {
+            return p ? (uint32_t)(p - sourceData + 1) : 0;
+        }
 
-    bool Project::addItem(NeXTSTEP::KeyValue* kv) {
-        assert(kv);
-        assert(kv->value.isObject());
-        if (!kv || !kv->value.isObject()) {
-            return false;
+        void write(const NeXTSTEP::Value& value) {
+            if (value.isString()) {
+                words.push_back(SnapshotTag::String);
+                words.push_back(string(value.string()));
+            } else if (value.isArray()) {
+                const NeXTSTEP::Array* array = value.array();
+                words.push_back(SnapshotTag::Array);
+                words.push_back((uint32_t)array->size());
+                for (auto iter = array->begin(); iter != array->end(); ++iter) {
+                    write(*iter);
+                }
+            } else if (value.isObject()) {
+                const NeXTSTEP::Object* object = value.object();
+                words.push_back(SnapshotTag::Object);
+                words.push_back((uint32_t)object->size());
+                for (auto iter = object->begin(); iter != object->end(); ++iter) {
+                    words.push_back(string((*iter)->key.c_str()));
+                    words.push_back(source((*iter)->sourceBegin));
+                    words.push_back(source((*iter)->sourceEnd));
+                    write((*iter)->value);
+                }
+            }
         }
-        NeXTSTEP::Object* obj = kv->value.object();
-        const char* isa = obj->stringByKey("isa");
-        if (!isa) {
-            return false;
+    };
+
+    struct SnapshotReader {
+        const char* strings;
+        size_t stringsSize;
+        const uint32_t* words;
+        size_t wordCount;
+        size_t pos;
+        const char* sourceData;
+        size_t sourceLength;
+        bool ok;
+
+        uint32_t next() {
+            if (pos >= wordCount) {
+                ok = false;
+                return 0;
+            }
+            return words[pos++];
         }
-        bool findSection = false;
-        for (auto iterSection = _sections.begin(); iterSection != _sections.end(); ++iterSection) {
-            if (iterSection->type.compare(isa) == 0) {
-                for (auto i = iterSection->items.begin(); i != iterSection->items.end(); ++i) {
-                    if ((*i)->key.compare(kv->key) >= 0) {
-                        iterSection->items.insert(i, kv);
-                        findSection = true;
-                        break;
-                    }
+
+        const char* string() {
+            uint32_t offset = next();
+            if (offset >= stringsSize) {
+                ok = false;
+                return "";
+            }
+            return strings + offset;
+        }
+
+        // NULL for 0, else the string at offset - 1
+        const char* optionalString() {
+            uint32_t offset = next();
+            if (!offset) {
+                return NULL;
+            }
+            if (offset > stringsSize) {
+                ok = false;
+                return NULL;
+            }
+            return strings + offset - 1;
+        }
+
+        const char* source() {
+            uint32_t offset = next();
+            if (!offset) {
+                return NULL;
+            }
+            if (offset > sourceLength + 1) {
+                ok = false;
+                return NULL;
+            }
+            return sourceData + offset - 1;
+        }
+
+        NeXTSTEP::Value read(NeXTSTEP::NodeArena* arena) {
+            NeXTSTEP::NodeArena::Scope scope(arena);
+            return read();
+        }
+
+        NeXTSTEP::Value read() {
+            const uint32_t tag = next();
+            if (tag == SnapshotTag::String) {
+                return NeXTSTEP::Value::NewSharedString(string());
+            } else if (tag == SnapshotTag::Array) {
+                NeXTSTEP::Array* array = new NeXTSTEP::Array();
+                NeXTSTEP::Value value = NeXTSTEP::Value::NewArray(array);
+                const uint32_t count = next();
+                array->reserve(std::min<size_t>(count, wordCount));
+                for (uint32_t i = 0; ok && i < count; ++i) {
+                    array->push_back(read());
                 }
-                if (!findSection) {
-                    iterSection->items.push_back(kv);
-                    findSection = true;
+                return value;
+            } else if (tag == SnapshotTag::Object) {
+                NeXTSTEP::Object* object = new NeXTSTEP::Object();
+                NeXTSTEP::Value value = NeXTSTEP::Value::NewObject(object);
+                const uint32_t count = next();
+                object->reserve(std::min<size_t>(count, wordCount));
+                for (uint32_t i = 0; ok && i < count; ++i) {
+                    NeXTSTEP::KeyValue* kv = new NeXTSTEP::KeyValue();
+                    object->push_back(kv);
+                    kv->key = string();
+                    kv->sourceBegin = source();
+                    kv->sourceEnd = source();
+                    if ((kv->sourceBegin == NULL) != (kv->sourceEnd == NULL) || kv->sourceBegin > kv->sourceEnd) {
+                        ok = false;
+                    }
+                    kv->value = read();
                 }
+                return value;
             }
+            ok = false;
+            return NeXTSTEP::Value::NewSharedString("");
         }
-        if (findSection) {
-            std::string sectionComment = kBegin + isa + kSection;
-            for (auto iter = _objects->begin(); iter != _objects->end(); ++iter) {
-                if (!(*iter)->key.empty()) {
-                    continue;
+    };
+
+    bool Project::loadSnapshot(const char* file, char* src) {
+        if (!_snapshot.open(file)) {
+            return false;
+        }
+        const size_t length = strlen(src);
+        SnapshotHeader header;
+        bool valid = _snapshot.size() >= sizeof(header);
+        if (valid) {
+            memcpy(&header, _snapshot.data(), sizeof(header));
+            valid = memcmp(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic)) == 0 &&
+                header.version == kSnapshotVersion && header.headerSize == sizeof(header) &&
+                header.sourceLength == length && header.stringsSize % 4 == 0 &&
+                header.wordCount <= _snapshot.size() / 4 &&
+                _snapshot.size() == sizeof(header) + header.stringsSize + header.wordCount * 4;
+        }
+        // stale
+        if (valid) {
+            valid = header.sourceHash == HashData(src, length);
+        }
+        // corrupt
+        if (valid) {
+            const char* payload = _snapshot.data() + sizeof(header);
+            valid = header.payloadHash == HashData(payload, _snapshot.size() - sizeof(header)) &&
+                (!header.stringsSize || payload[header.stringsSize - 1] == 0);
+        }
+        if (!valid) {
+            _snapshot.close();
+            return false;
+        }
+
+        NeXTSTEP::NodeArena arena;
+        SnapshotReader reader;
+        reader.strings = _snapshot.data() + sizeof(header);
+        reader.stringsSize = (size_t)header.stringsSize;
+        reader.words = (const uint32_t*)(reader.strings + header.stringsSize);
+        reader.wordCount = (size_t)header.wordCount;
+        reader.pos = 0;
+        reader.sourceData = src;
+        reader.sourceLength = length;
+        reader.ok = true;
+        NeXTSTEP::Value root = reader.read(&arena);
+        if (!reader.ok || !root.isObject()) {
+            _snapshot.close();
+            return false;
+        }
+
+        // src is not parsed in place, it is the source text itself
+        _sourceCopy.clear();
+        _source = src;
+        _sourceLength = length;
+        _sourceData = src;
+        _touched.clear();
+        _modified = false;
+        _plist.assign(std::move(root), src);
+        _plist.arena().adopt(arena);
+        if (!buildIndex(false, false) || !restorePaths(reader)) {
+            clearIndex();
+            _plist.clear();
+            _snapshot.close();
+            return false;
+        }
+        return true;
+    }
+
+    // the path index and targets as saved, instead of walking the groups and
+    // build phases and resolving every path again
+    bool Project::restorePaths(SnapshotReader& reader) {
+        auto objectOf = [&](const char* key, IsaType::Enum isa) -> const NeXTSTEP::KeyValue* {
+            const auto iter = _objectmap.find(key);
+            if (iter == _objectmap.end() || IsaType::Of(iter->second->value.object()) != isa) {
+                reader.ok = false;
+                return NULL;
+            }
+            return iter->second;
+        };
+
+        const uint32_t pathCount = reader.next();
+        _pathmap.reserve(std::min<size_t>(pathCount, reader.wordCount));
+        _pathByObject.reserve(_pathmap.bucket_count());
+        _pathByFullpath.reserve(_pathmap.bucket_count());
+        for (uint32_t i = 0; reader.ok && i < pathCount; ++i) {
+            const char* key = reader.string();
+            const char* parentKey = reader.optionalString();
+            const char* fullpath = reader.string();
+            const uint32_t tree = reader.next();
+            const uint32_t file = reader.next();
+            if (tree > SourceTreeType::Products || file > 1) {
+                return false;
+            }
+            const NeXTSTEP::KeyValue* kv = objectOf(key, file ? IsaType::PBXFileReference : IsaType::PBXGroup);
+            const NeXTSTEP::KeyValue* parent = parentKey ? objectOf(parentKey, IsaType::PBXGroup) : NULL;
+            if (!reader.ok) {
+                return false;
+            }
+            PBXPath path(kv->value.object(), kv->key.c_str(), parent ? parent->key.c_str() : NULL, fullpath, (SourceTreeType::Enum)tree, file != 0);
+            if (!insertPath(kv->key.c_str(), std::move(path))) {
+                return false;
+            }
+        }
+
+        const uint32_t targetCount = reader.next();
+        _targets.reserve(std::min<size_t>(targetCount, reader.wordCount));
+        for (uint32_t i = 0; reader.ok && i < targetCount; ++i) {
+            const NeXTSTEP::KeyValue* kv = objectOf(reader.string(), IsaType::PBXNativeTarget);
+            if (kv) {
+                _targets.push_back(kv->value.object());
+            }
+        }
+        NeXTSTEP::Object* project = object(_plist.stringByKey("rootObject"));
+        if (project && IsaType::Of(project) == IsaType::PBXProject) {
+            _project = project;
+        }
+        return reader.ok && reader.pos == reader.wordCount;
+    }
+
+    bool Project::saveSnapshot(const char* file) const {
+        if (!_plist.isObject() || _sourceLength >= UINT32_MAX) {
+            return false;
+        }
+        SnapshotWriter writer;
+        writer.sourceData = _sourceData;
+        writer.write(_plist);
+
+        // the group tree from the main group as buildIndex() walks it, a group
+        // after its children, so the paths are inserted in the same order
+        std::vector<const PBXPath*> paths;
+        paths.reserve(_pathmap.size());
+        {
+            ObjectKey_set visited;
+            auto visit = [&](const char* key) {
+                const auto iter = key ? _pathmap.find(key) : _pathmap.end();
+                if (iter != _pathmap.end() && visited.insert(iter->first).second) {
+                    paths.push_back(&iter->second);
                 }
-                if (!(*iter)->value.isString()) {
+            };
+            struct Frame {
+                const char* key;
+                const NeXTSTEP::Array* children;
+                size_t next;
+            };
+            std::deque<Frame> stack;
+            const char* mainGroup = _project ? _project->stringByKey("mainGroup") : NULL;
+            const NeXTSTEP::Object* mainObj = mainGroup ? object(mainGroup) : NULL;
+            if (mainObj && IsaType::Of(mainObj) == IsaType::PBXGroup) {
+                stack.push_back({mainGroup, mainObj->arrayByKey("children"), 0});
+            }
+            while (!stack.empty()) {
+                Frame& frame = stack.back();
+                if (!frame.children || frame.next >= frame.children->size()) {
+                    visit(frame.key);
+                    stack.pop_back();
                     continue;
                 }
-                if (strcmp((*iter)->value.string(), sectionComment.c_str()) != 0) {
+                const NeXTSTEP::Value& child = (*frame.children)[frame.next++];
+                if (!child.isString()) {
                     continue;
                 }
-                for (auto iter2 = iter + 1; iter2 != _objects->end(); ++iter2) {
-                    if ((*iter2)->key.empty()) {
-                        _objects->insert(iter2, kv);
-                        break;
-                    }
-                    if ((*iter2)->key.compare(kv->key) >= 0) {
-                        _objects->insert(iter2, kv);
-                        break;
+                const NeXTSTEP::Object* childObj = object(child.string());
+                if (childObj && IsaType::Of(childObj) == IsaType::PBXGroup) {
+                    stack.push_back({child.string(), childObj->arrayByKey("children"), 0});
+                } else {
+                    visit(child.string());
+                }
+            }
+        }
+        // paths added since parsed
+        if (paths.size() != _pathmap.size()) {
+            return false;
+        }
+        writer.words.push_back((uint32_t)paths.size());
+        for (auto iter = paths.begin(); iter != paths.end(); ++iter) {
+            const PBXPath* path = *iter;
+            writer.words.push_back(writer.string(path->key));
+            writer.words.push_back(path->parentKey ? writer.string(path->parentKey) + 1 : 0);
+            writer.words.push_back(writer.string(path->pathFromSourceTree.c_str()));
+            writer.words.push_back((uint32_t)path->sourceTree);
+            writer.words.push_back(path->isFile ? 1 : 0);
+        }
+        // targets by their keys in the project, in the order of _targets
+        std::vector<const char*> targets;
+        const NeXTSTEP::Array* projectTargets = _project ? _project->arrayByKey("targets") : NULL;
+        if (projectTargets) {
+            for (auto iter = projectTargets->begin(); iter != projectTargets->end(); ++iter) {
+                const NeXTSTEP::Object* target = iter->isString() ? object(iter->string()) : NULL;
+                if (target && IsaType::Of(target) == IsaType::PBXNativeTarget) {
+                    if (targets.size() >= _targets.size() || _targets[targets.size()] != target) {
+                        return false;
                     }
+                    targets.push_back(iter->string());
                 }
-                break;
             }
         }
-        return findSection;
+        if (targets.size() != _targets.size()) {
+            return false;
+        }
+        writer.words.push_back((uint32_t)targets.size());
+        for (auto iter = targets.begin(); iter != targets.end(); ++iter) {
+            writer.words.push_back(writer.string(*iter));
+        }
+        // words are aligned
+        while (writer.strings.length() % 4) {
+            writer.strings.push_back(0);
+        }
+
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+        header.version = kSnapshotVersion;
+        header.headerSize = sizeof(header);
+        header.sourceHash = HashData(_source, _sourceLength);
+        header.sourceLength = _sourceLength;
+        header.stringsSize = writer.strings.length();
+        header.wordCount = writer.words.size();
+        shared::StrBuf payload;
+        payload.reserve(writer.strings.length() + writer.words.size() * 4);
+        payload.append(writer.strings.data(), writer.strings.length());
+        payload.append((const char*)writer.words.data(), writer.words.size() * 4);
+        header.payloadHash = HashData(payload.data(), payload.length());
+
+        FileWriterWithCheck out(file);
+        out.write((const char*)&header, sizeof(header));
+        out.write(payload.data(), payload.length());
+        return out.close();
+    }
+
+    const PBXPath* Project::findGroupOrFilePath(NeXTSTEP::Object* obj) const {
+        const auto iter = _pathByObject.find(obj);
+        if (iter == _pathByObject.end()) {
+            return NULL;
+        }
+        return iter->second;
+    }
+
+    const PBXPath* Project::findGroupOrFilePath(const char* fullpath) const {
+        // a group without path shares the full path of its parent, prefer file
+        const PBXPath* found = NULL;
+        const auto range = _pathByFullpath.equal_range(fullpath);
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            if (iter->second->isFile) {
+                return iter->second;
+            }
+            if (!found) {
+                found = iter->second;
+            }
+        }
+        return found;
     }
 
-    void Project::removeItem(const char* key) {
-        if (!key || !key[0]) {
-            return;
+    const PBXPath* Project::findChildGroupOrFilePath(const PBXPath* parent, const char* path, bool file) const {
+        if (!parent || !path) {
+            return NULL;
+        }
+        const auto children = _pathByParent.find(parent->key);
+        if (children == _pathByParent.end()) {
+            return NULL;
         }
-        auto iter = _objects->begin();
-        for (; iter != _objects->end(); ++iter) {
-            if ((*iter)->key.compare(key) == 0) {
+        const auto range = children->second.equal_range(path);
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            if (iter->second->isFile == file) {
+                return iter->second;
+            }
+        }
+        return NULL;
+    }
+
+    const PBXPath* Project::insertPath(const char* key, PBXPath&& path) {
+        auto result = _pathmap.insert({key, std::move(path)});
+        if (!result.second) {
+            return NULL;
+        }
+        const PBXPath* info = &result.first->second;
+        _pathByObject.insert({info->obj, info});
+        _pathByFullpath.insert({info->pathFromSourceTree.c_str(), info});
+        if (info->parentKey && info->path) {
+            _pathByParent[info->parentKey].insert({info->path, info});
+        }
+        return info;
+    }
+
+    static void eraseFromPathIndex(PBXPath_pathmap& index, const char* key, const PBXPath* info) {
+        const auto range = index.equal_range(key);
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            if (iter->second == info) {
+                index.erase(iter);
                 break;
             }
         }
-        if (iter == _objects->end()) {
+    }
+
+    void Project::erasePath(const char* key) {
+        auto iter = _pathmap.find(key);
+        if (iter == _pathmap.end()) {
             return;
         }
-        if (!(*iter)->value.isObject()) {
-            return;
+        const PBXPath* info = &iter->second;
+        if (!info->isFile) {
+            // paths of the children refer to the group, they go with it
+            auto children = _pathByParent.find(info->key);
+            if (children != _pathByParent.end()) {
+                std::vector<const char*> keys;
+                for (auto child = children->second.begin(); child != children->second.end(); ++child) {
+                    keys.push_back(child->second->key);
+                }
+                for (auto child = keys.begin(); child != keys.end(); ++child) {
+                    erasePath(*child);
+                }
+            }
         }
-        NeXTSTEP::Object* obj = (*iter)->value.object();
-        const char* isa = obj->stringByKey("isa");
-        if (!isa) {
-            return;
+        _pathByObject.erase(info->obj);
+        eraseFromPathIndex(_pathByFullpath, info->pathFromSourceTree.c_str(), info);
+        if (info->parentKey && info->path) {
+            auto children = _pathByParent.find(info->parentKey);
+            if (children != _pathByParent.end()) {
+                eraseFromPathIndex(children->second, info->path, info);
+                if (children->second.empty()) {
+                    _pathByParent.erase(children);
+                }
+            }
         }
-        for (auto iterSection = _sections.begin(); iterSection != _sections.end(); ++iterSection) {
-            if (iterSection->type.compare(isa) == 0) {
-                for (auto i = iterSection->items.begin(); i != iterSection->items.end(); ++i) {
-                    if ((*i)->key.compare(key) == 0) {
-                        iterSection->items.erase(i);
-                        break;
+        if (!info->isFile) {
+            _pathByParent.erase(info->key);
+        }
+        _pathmap.erase(iter);
+    }
+
+    NeXTSTEP::Object* Project::object(const char* key) const {
+        if (!key) {
+            return NULL;
+        }
+        const auto iter = _objectmap.find(key);
+        if (iter == _objectmap.end() || !iter->second->value.isObject()) {
+            return NULL;
+        }
+        return iter->second->value.object();
+    }
+
+    Section* Project::findSection(const NeXTSTEP::Object* obj) {
+        const IsaType::Enum isa = IsaType::Of(obj);
+        if (isa == IsaType::Unknown) {
+            const char* type = obj->stringByKey("isa");
+            return type ? findSection(type) : NULL;
+        }
+        if (isa > IsaType::Unknown && isa < IsaType::Count && _sectionByIsa[isa] >= 0) {
+            return &_sections[_sectionByIsa[isa]];
+        }
+        return NULL;
+    }
+
+    Section* Project::ensureSection(IsaType::Enum isa) {
+        if (isa <= IsaType::Unknown || isa >= IsaType::Count) {
+            return NULL;
+        }
+        if (_sectionByIsa[isa] >= 0) {
+            return &_sections[_sectionByIsa[isa]];
+        }
+        Section section;
+        section.type = IsaType::ToString(isa);
+        section.isa = isa;
+        auto iter = _sections.begin();
+        while (iter != _sections.end() && iter->type.compare(section.type) < 0) {
+            ++iter;
+        }
+        iter = _sections.insert(iter, std::move(section));
+        for (size_t i = 0; i < _countof(_sectionByIsa); ++i) {
+            _sectionByIsa[i] = -1;
+        }
+        for (size_t i = 0; i < _sections.size(); ++i) {
+            const IsaType::Enum type = _sections[i].isa;
+            if (type > IsaType::Unknown && _sectionByIsa[type] < 0) {
+                _sectionByIsa[type] = (int32_t)i;
+            }
+        }
+        _objectsSorted = false;
+        return &*iter;
+    }
+
+    Section* Project::findSection(const char* type) {
+        for (auto iter = _sections.begin(); iter != _sections.end(); ++iter) {
+            if (iter->type.compare(type) == 0) {
+                return &*iter;
+            }
+        }
+        return NULL;
+    }
+
+    Project::Edit::~Edit() {
+        clear();
+    }
+
+    void Project::Edit::add(NeXTSTEP::KeyValue* kv) {
+        _adds.push_back(kv);
+    }
+
+    void Project::Edit::add(NeXTSTEP::KeyValue* kv, const PBXPath* parent, bool file) {
+        _adds.push_back(kv);
+        PathAdd path;
+        path.kv = kv;
+        path.parentKey = parent ? parent->key : NULL;
+        path.file = file;
+        _paths.push_back(path);
+    }
+
+    void Project::Edit::remove(const char* key) {
+        if (key && key[0] && !removing(key)) {
+            _removes.push_back(key);
+            _removeKeys.insert(_removes.back().c_str());
+        }
+    }
+
+    void Project::Edit::rewrite(NeXTSTEP::Object* owner, const char* key, std::vector<std::string>&& values) {
+        NeXTSTEP::Array* array = owner ? owner->arrayByKey(key) : NULL;
+        for (auto iter = _rewrites.begin(); iter != _rewrites.end(); ++iter) {
+            if (array && iter->array == array) {
+                iter->values = std::move(values);
+                return;
+            }
+        }
+        ArrayRewrite item;
+        item.owner = owner;
+        item.array = array;
+        item.values = std::move(values);
+        _rewrites.push_back(std::move(item));
+    }
+
+    void Project::Edit::set(NeXTSTEP::Object* item, NeXTSTEP::Object* owner, const char* key, NeXTSTEP::Object* value) {
+        ObjectSet set;
+        set.item = item;
+        set.owner = owner;
+        set.key = key;
+        set.value = value;
+        _sets.push_back(std::move(set));
+    }
+
+    std::vector<std::string>* Project::Edit::values(NeXTSTEP::Object* owner, const char* key) {
+        NeXTSTEP::Array* array = owner ? owner->arrayByKey(key) : NULL;
+        if (!array) {
+            return NULL;
+        }
+        for (auto iter = _rewrites.begin(); iter != _rewrites.end(); ++iter) {
+            if (iter->array == array) {
+                return &iter->values;
+            }
+        }
+        ArrayRewrite item;
+        item.owner = owner;
+        item.array = array;
+        for (auto iter = array->begin(); iter != array->end(); ++iter) {
+            if (iter->isString()) {
+                item.values.push_back(iter->string());
+            }
+        }
+        _rewrites.push_back(std::move(item));
+        return &_rewrites.back().values;
+    }
+
+    bool Project::Edit::takeId(const SId& id) {
+        if (_ids.find(id) != _ids.end()) {
+            return false;
+        }
+        if (_project._objectmap.find(id) != _project._objectmap.end() && !removing(id)) {
+            return false;
+        }
+        _ids.insert(id);
+        return true;
+    }
+
+    void Project::Edit::clear() {
+        for (auto iter = _adds.begin(); iter != _adds.end(); ++iter) {
+            delete *iter;
+        }
+        _adds.clear();
+        for (auto iter = _sets.begin(); iter != _sets.end(); ++iter) {
+            delete iter->value;
+        }
+        _sets.clear();
+        _paths.clear();
+        _removeKeys.clear();
+        _removes.clear();
+        _rewrites.clear();
+        _ids.clear();
+    }
+
+    bool Project::Edit::validate() const {
+        const ObjectKey_set& removes = _removeKeys;
+        ObjectKey_set adds;
+        for (auto iter = _adds.begin(); iter != _adds.end(); ++iter) {
+            const NeXTSTEP::KeyValue* kv = *iter;
+            if (!kv || kv->isComment() || !kv->value.isObject()) {
+                LOG_E("Invalid item to add\n");
+                return false;
+            }
+            if (!_project.findSection(kv->value.object())) {
+                LOG_E("No section for %s\n", kv->key.c_str());
+                return false;
+            }
+            const bool exists = _project._objectmap.find(kv->key.c_str()) != _project._objectmap.end();
+            if ((exists && removes.find(kv->key.c_str()) == removes.end()) || !adds.insert(kv->key.c_str()).second) {
+                LOG_E("Duplicated key %s\n", kv->key.c_str());
+                return false;
+            }
+        }
+
+        auto resolved = [&](const char* key) -> bool {
+            if (adds.find(key) != adds.end()) {
+                return true;
+            }
+            return removes.find(key) == removes.end() && _project._objectmap.find(key) != _project._objectmap.end();
+        };
+        auto resolvedArray = [&](const NeXTSTEP::Array* array) -> bool {
+            if (array) {
+                for (auto iter = array->begin(); iter != array->end(); ++iter) {
+                    if (iter->isString() && !resolved(iter->string())) {
+                        LOG_E("Unresolved reference %s\n", iter->string());
+                        return false;
                     }
                 }
             }
+            return true;
+        };
+
+        for (auto iter = _adds.begin(); iter != _adds.end(); ++iter) {
+            const NeXTSTEP::Value& value = (*iter)->value;
+            const char* fileRef = value.stringByKey("fileRef");
+            if (fileRef && !resolved(fileRef)) {
+                LOG_E("Unresolved reference %s\n", fileRef);
+                return false;
+            }
+            if (!resolvedArray(value.arrayByKey("children")) || !resolvedArray(value.arrayByKey("files"))) {
+                return false;
+            }
         }
-        if (iter != _objects->end()) {
-            delete *iter;
-            _objects->erase(iter);
+        for (auto iter = _paths.begin(); iter != _paths.end(); ++iter) {
+            if (!iter->parentKey || removes.find(iter->parentKey) != removes.end() ||
+                _project._pathmap.find(iter->parentKey) == _project._pathmap.end()) {
+                LOG_E("No parent group for %s\n", iter->kv->key.c_str());
+                return false;
+            }
         }
+        for (auto iter = _sets.begin(); iter != _sets.end(); ++iter) {
+            if (!iter->item || !iter->owner) {
+                LOG_E("No object to set %s\n", iter->key.c_str());
+                return false;
+            }
+        }
+        for (auto iter = _rewrites.begin(); iter != _rewrites.end(); ++iter) {
+            if (!iter->array) {
+                LOG_E("No array to rewrite\n");
+                return false;
+            }
+            for (auto i2 = iter->values.begin(); i2 != iter->values.end(); ++i2) {
+                if (!resolved(i2->c_str())) {
+                    LOG_E("Unresolved reference %s\n", i2->c_str());
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool Project::Edit::commit() {
+        if (!_project.valid() || !validate()) {
+            clear();
+            return false;
+        }
+        Project& proj = _project;
+
+        // removes, one pass over objects
+        if (!_removes.empty()) {
+            ObjectKey_set removes;
+            for (auto iter = _removes.begin(); iter != _removes.end(); ++iter) {
+                if (proj._objectmap.find(iter->c_str()) != proj._objectmap.end()) {
+                    removes.insert(iter->c_str());
+                    proj.erasePath(iter->c_str());
+                }
+            }
+            if (!removes.empty()) {
+                auto dst = proj._objects->begin();
+                for (auto iter = proj._objects->begin(); iter != proj._objects->end(); ++iter) {
+                    NeXTSTEP::KeyValue* kv = *iter;
+                    if (!kv->isComment() && removes.find(kv->key.c_str()) != removes.end()) {
+                        Section* section = kv->value.isObject() ? proj.findSection(kv->value.object()) : NULL;
+                        if (section) {
+                            section->items.erase(kv->key.c_str());
+                            if (section->isa == IsaType::PBXNativeTarget) {
+                                auto target = std::find(proj._targets.begin(), proj._targets.end(), kv->value.object());
+                                if (target != proj._targets.end()) {
+                                    proj._targets.erase(target);
+                                }
+                            }
+                        }
+                        proj._objectmap.erase(kv->key.c_str());
+                        delete kv;
+                    } else {
+                        *(dst++) = kv;
+                    }
+                }
+                proj._objects->erase(dst, proj._objects->end());
+                proj._modified = true;
+            }
+        }
+
+        // adds
+        if (!_adds.empty()) {
+            proj._objects->reserve(proj._objects->size() + _adds.size());
+            for (auto iter = _adds.begin(); iter != _adds.end(); ++iter) {
+                NeXTSTEP::KeyValue* kv = *iter;
+                Section* section = proj.findSection(kv->value.object());
+                kv->value.object()->tag = section->isa;
+                section->items.insert(kv);
+                proj._objects->push_back(kv);
+                proj._objectmap.insert({kv->key.c_str(), kv});
+                if (section->isa == IsaType::PBXNativeTarget) {
+                    proj._targets.push_back(kv->value.object());
+                }
+            }
+            proj._objectsSorted = false;
+            proj._modified = true;
+            _adds.clear();
+        }
+        for (auto iter = _paths.begin(); iter != _paths.end(); ++iter) {
+            const NeXTSTEP::KeyValue* kv = iter->kv;
+            const PBXPath* parent = &proj._pathmap.find(iter->parentKey)->second;
+            proj.insertPath(kv->key.c_str(), PBXPath(kv->value.object(), kv->key.c_str(), parent, iter->file));
+        }
+
+        // values set in objects
+        for (auto iter = _sets.begin(); iter != _sets.end(); ++iter) {
+            NeXTSTEP::Object* owner = iter->owner;
+            proj.touch(iter->item);
+            owner->remove(iter->key.c_str());
+            if (iter->value) {
+                auto pos = owner->begin();
+                while (pos != owner->end() && strcmp((*pos)->key.c_str(), iter->key.c_str()) < 0) {
+                    ++pos;
+                }
+                owner->insert(pos, new NeXTSTEP::KeyValue(iter->key.c_str(), iter->value));
+                iter->value = NULL;
+            }
+        }
+        _sets.clear();
+
+        // array rewrites
+        for (auto iter = _rewrites.begin(); iter != _rewrites.end(); ++iter) {
+            NeXTSTEP::Array* array = iter->array;
+            proj.touch(iter->owner);
+            array->clear();
+            array->reserve(iter->values.size());
+            for (auto i2 = iter->values.begin(); i2 != iter->values.end(); ++i2) {
+                array->push_back(NeXTSTEP::Value::NewString(i2->c_str()));
+            }
+        }
+
+        clear();
+        return true;
+    }
+
+    void Project::sortObjects() {
+        if (_objectsSorted || !_objects) {
+            return;
+        }
+        _objects->clear();
+        for (auto iter = _sections.begin(); iter != _sections.end(); ++iter) {
+            if (iter->beginComment) {
+                _objects->push_back(iter->beginComment);
+            }
+            for (auto i2 = iter->items.begin(); i2 != iter->items.end(); ++i2) {
+                _objects->push_back(*i2);
+            }
+            if (iter->endComment) {
+                _objects->push_back(iter->endComment);
+            }
+        }
+        _objectsSorted = true;
+    }
+
+    void Project::touch(const NeXTSTEP::Object* obj) {
+        _touched.insert(obj);
+        _modified = true;
     }
 
     void Project::write(shared::StrBuf& buf) const {
+        buf.reserve(buf.length() + _sourceLength + _sourceLength / 8);
+        write(buf, NULL);
+    }
+
+    bool Project::write(FileWriterWithCheck& out) const {
+        shared::StrBuf buf;
+        buf.reserve(FileWriterWithCheck::kBufferSize * 2);
+        write(buf, &out);
+        out.flush(buf, true);
+        return out.close();
+    }
+
+    void Project::write(shared::StrBuf& buf, FileWriterWithCheck* out) const {
 #if 0
         _plist.write(0, buf);
 #else
@@ -532,7 +1658,7 @@ namespace pbxproj {
             for (auto iter = obj.begin(); iter != obj.end(); ++iter) {
                 if ((*iter)->key.compare("objects") == 0) {
                     buf.append("\tobjects = {\n");
-                    writeObjects(buf);
+                    writeObjects(buf, out);
                     buf.append("\t};\n");
                 } else {
                     (*iter)->write(1, buf);
@@ -544,23 +1670,37 @@ namespace pbxproj {
 #endif
     }
 
-    void Project::writeObjects(shared::StrBuf& buf) const {
+    void Project::writeObjects(shared::StrBuf& buf, FileWriterWithCheck* out) const {
         for (auto iter = _sections.begin(); iter != _sections.end(); ++iter) {
+            // xcode writes no empty section
+            if (iter->items.empty()) {
+                continue;
+            }
             buf.append('\n');
             buf.appendf("/* Begin %s section */\n", iter->type.c_str());
 
-            int32_t indent = sectionBreakline(iter->type.c_str()) ? 2 : -1;
+            int32_t indent = sectionBreakline(iter->isa) ? 2 : -1;
             for (auto i2 = iter->items.begin(); i2 != iter->items.end(); ++i2) {
+                const NeXTSTEP::KeyValue* kv = *i2;
+                if (kv->sourceBegin && _touched.find(kv->value.object()) == _touched.end()) {
+                    // untouched, copy the parsed text
+                    buf.append("\t\t");
+                    buf.append(_source + (kv->sourceBegin - _sourceData), kv->sourceEnd - kv->sourceBegin);
+                } else {
 #if 0
-                buf.appendf("\t\t%s = ", i2->key().c_str());
-                (*i2)->value.write(indent, buf);
+                    buf.appendf("\t\t%s = ", i2->key().c_str());
+                    (*i2)->value.write(indent, buf);
 #else
-                if (indent < 0) {
-                    buf.appendf("\t\t");
-                }
-                (*i2)->write(indent, buf);
+                    if (indent < 0) {
+                        buf.appendf("\t\t");
+                    }
+                    (*i2)->write(indent, buf);
 #endif
+                }
                 buf.append(";\n");
+                if (out) {
+                    out->flush(buf);
+                }
             }
             buf.appendf("/* End %s section */\n", iter->type.c_str());
         }
@@ -571,7 +1711,7 @@ namespace pbxproj {
         shared::StrBuf* buf;
         const PBXPath_map* path_map;
 #if PROJ_WarnUnvisitNode
-        std::unordered_set<const char*, hash_c_str, equal_to_c_str> visited;
+        ObjectKey_set visited;
 #endif//PROJ_WarnUnvisitNode
         std::unordered_map<std::string, uint32_t> visitTimes;
 
@@ -21,33 +21,25 @@
 #ifndef pbxproj_parser_hpp
 #define pbxproj_parser_hpp
 #include <vector>
+#include <deque>
 #include <string>
 #include <stdint.h>
 #include "NeXTSTEP_plist.hpp"
 #include <shared/utils/StrBuf.h>
+#include <shared/file_utils.h>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
 #include "namehash.h"
 
 namespace pbxproj {
     struct SId {
         uint32_t _id[3];
-        void fromString(const char* str) {
-            const char* sid = "0123456789ABCDEF";
-            uint32_t id2 = 0;
-            for (size_t i = 0; i < 24; ++i) {
-                const char* pcur = strchr(sid, str[i]);
-                uint32_t index = pcur ? ((uint32_t)(pcur - sid)) : 0;
-                id2 <<= 4;
-                id2 |= index;
-                if ((i % 8) == 7) {
-                    _id[i / 8] = id2;
-                    id2 = 0;
-                }
-            }
-        }
-        void toString(char* out) const {
-            sprintf(out, "%08X%08X%08X", _id[0], _id[1], _id[2]);
-        }
+        // decodes 24 hex digits through a lookup table, false when str does
+        // not start with 24 hex digits
+        bool fromString(const char* str);
+        // writes 24 upper case hex digits and a terminating 0
+        void toString(char* out) const;
         std::string toString() const {
             char ch[32];
             toString(ch);
@@ -58,6 +50,14 @@ namespace pbxproj {
             toString(ch);
             printf("id:%s\n", ch);
         }
+        size_t hash() const {
+            uint64_t h = ((uint64_t)_id[0] << 32) | _id[1];
+            h ^= _id[2] * 0x9E3779B97F4A7C15ULL;
+            return (size_t)(h ^ (h >> 29));
+        }
+        bool operator==(const SId& other) const {
+            return _id[0] == other._id[0] && _id[1] == other._id[1] && _id[2] == other._id[2];
+        }
     };
 
     struct STag {
@@ -65,14 +65,158 @@ namespace pbxproj {
         std::string comment;
     };
 
+    struct less_c_str {
+        bool operator()(const char* lhs, const char* rhs) const noexcept {
+            return strcmp(lhs, rhs) < 0;
+        }
+    };
+
+    // Items of a section kept as an ordered list of runs sorted by key, so the
+    // parsed order is kept as is and insert by key is O(log n) for a sorted
+    // section (one run).
+    class SectionItems {
+    public:
+        typedef std::map<const char*, NeXTSTEP::KeyValue*, less_c_str> Run;
+
+        struct const_iterator {
+            const_iterator(const std::vector<Run>* runs, size_t run) : _runs(runs), _run(run), _item() {
+                skipEmpty();
+            }
+
+            NeXTSTEP::KeyValue* operator*() const {
+                return _item->second;
+            }
+            const_iterator& operator++() {
+                if (++_item == (*_runs)[_run].end()) {
+                    ++_run;
+                    skipEmpty();
+                }
+                return *this;
+            }
+            bool operator==(const const_iterator& other) const {
+                return _run == other._run && (_run == _runs->size() || _item == other._item);
+            }
+            bool operator!=(const const_iterator& other) const {
+                return !(*this == other);
+            }
+
+        private:
+            void skipEmpty() {
+                while (_run < _runs->size() && (*_runs)[_run].empty()) {
+                    ++_run;
+                }
+                if (_run < _runs->size()) {
+                    _item = (*_runs)[_run].begin();
+                }
+            }
+
+            const std::vector<Run>* _runs;
+            size_t _run;
+            Run::const_iterator _item;
+        };
+
+        SectionItems() : _size(0), _indexed(true) {
+        }
+
+        const_iterator begin() const {
+            return const_iterator(&_runs, 0);
+        }
+        const_iterator end() const {
+            return const_iterator(&_runs, _runs.size());
+        }
+        size_t size() const {
+            return _size;
+        }
+        bool empty() const {
+            return !_size;
+        }
+
+        // append in parsed order
+        void push_back(NeXTSTEP::KeyValue* kv);
+        // insert before the first item whose key is not less than kv's key
+        void insert(NeXTSTEP::KeyValue* kv);
+        bool erase(const char* key);
+
+        void swap(SectionItems& other) {
+            std::swap(_runs, other._runs);
+            std::swap(_size, other._size);
+            std::swap(_byLast, other._byLast);
+            std::swap(_indexed, other._indexed);
+        }
+        void clear() {
+            _runs.clear();
+            _size = 0;
+            _byLast.clear();
+            _indexed = true;
+        }
+
+    private:
+        // first run not before run whose last key is not less than key
+        size_t findRun(const char* key);
+        void indexLast(size_t run);
+        void buildIndex();
+
+        std::vector<Run> _runs;
+        size_t _size;
+        // runs by their last key, only those ending after all runs before
+        // them, lower_bound is the first run with a key not less than a key
+        std::map<const char*, size_t, less_c_str> _byLast;
+        // false when a split or erase changed the last keys
+        bool _indexed;
+    };
+
+    struct IsaType {
+        enum Enum {
+            None,
+            Unknown, // isa not in the list below
+            PBXBuildFile,
+
+            PBXFileReference,
+            PBXGroup,
+            PBXVariantGroup,
+
+            PBXProject,
+            PBXTargetDependency,
+            PBXContainerItemProxy,
+            PBXReferenceProxy,
+            XCBuildConfiguration,
+            XCConfigurationList,
+
+            // BuildPhase
+            PBXBuildPhase,
+            PBXAppleScriptBuildPhase,
+            PBXHeadersBuildPhase,
+            PBXSourcesBuildPhase,
+            PBXFrameworksBuildPhase,
+            PBXCopyFilesBuildPhase,
+            PBXResourcesBuildPhase,
+            PBXShellScriptBuildPhase,
+
+            // Target
+            PBXTarget,
+            PBXAggregateTarget,
+            PBXLegacyTarget,
+            PBXNativeTarget,
+
+            Count,
+        };
+        static Enum FromString(const char* src);
+        static const char* ToString(Enum src);
+        // tag of a top-level object, or resolved from its isa
+        static Enum Of(const NeXTSTEP::Object* obj);
+    };
+
     struct Section {
         std::string type;
-        std::vector<const NeXTSTEP::KeyValue*> items;
+        IsaType::Enum isa;
+        SectionItems items;
+        NeXTSTEP::KeyValue* beginComment;
+        NeXTSTEP::KeyValue* endComment;
 
-        Section() {
+        Section() : isa(IsaType::None), beginComment(NULL), endComment(NULL) {
         }
 
-        Section(Section&& other) {
+        Section(Section&& other) : isa(IsaType::None), beginComment(NULL), endComment(NULL) {
             swap(other);
         }
         void operator=(Section&& other) {
@@ -81,12 +225,18 @@ namespace pbxproj {
 
         void swap(Section& other) {
             std::swap(type, other.type);
-            std::swap(items, other.items);
+            std::swap(isa, other.isa);
+            items.swap(other.items);
+            std::swap(beginComment, other.beginComment);
+            std::swap(endComment, other.endComment);
         }
 
         void clear() {
             type.clear();
+            isa = IsaType::None;
             items.clear();
+            beginComment = NULL;
+            endComment = NULL;
         }
 
     private:
@@ -123,6 +273,10 @@ namespace pbxproj {
         bool isFile;
 
         PBXPath(const NeXTSTEP::Object* o, const char* key, const PBXPath* parent, bool file);
+        // restored from a snapshot, the path from source tree is already resolved
+        PBXPath(const NeXTSTEP::Object* o, const char* key, const char* parentKey, const char* fullpath, SourceTreeType::Enum tree, bool file)
+        : pathFromSourceTree(fullpath), obj(o), key(key), path(o->stringByKey("path")), parentKey(parentKey), sourceTree(tree), isFile(file) {
+        }
 
         PBXPath(const PBXPath& other) : pathFromSourceTree(other.pathFromSourceTree) {
             obj = other.obj;
@@ -159,29 +313,66 @@ namespace pbxproj {
         PBXPath& operator=(const PBXPath& other) = delete;
     };
 
-    struct hash_c_str {
+    // Key of an object or a reference to it, "<24 hex digit id> /* comment */"
+    // is decoded once and hashed and compared as a 96-bit integer, the comment
+    // is ignored as Xcode does. Any other key is hashed and compared as text.
+    struct ObjectKey {
+        ObjectKey(const char* key) : text(key) {
+            isId = id.fromString(key) && (key[24] == 0 || key[24] == ' ');
+        }
+        ObjectKey(const SId& id) : id(id), text(NULL), isId(true) {
+        }
+        bool operator==(const ObjectKey& other) const {
+            if (isId != other.isId) {
+                return false;
+            }
+            return isId ? id == other.id : strcmp(text, other.text) == 0;
+        }
+
+        SId id;
+        const char* text;
+        bool isId;
+    };
+
+    struct hash_object_key {
+        size_t operator()(const ObjectKey& key) const noexcept {
+            return key.isId ? key.id.hash() : TableHashString(key.text);
+        }
+    };
+
+    typedef std::unordered_set<ObjectKey, hash_object_key> ObjectKey_set;
+
+    struct hash_sid {
+        size_t operator()(const SId& id) const noexcept {
+            return id.hash();
+        }
+    };
+
+    typedef std::unordered_set<SId, hash_sid> SId_set;
+
+    struct hash_path_c_str {
         size_t operator()(const char* str) const noexcept {
-            return HashString(str, 131);
+            return TableHashPath(str);
         }
     };
 
-    struct equal_to_c_str {
+    struct equal_to_path_c_str {
         bool operator()(const char* lhs, const char* rhs) const noexcept {
-            return strcmp(lhs, rhs) == 0;
+            return strcasecmp(lhs, rhs) == 0;
         }
     };
 
-    typedef std::unordered_map<const char*, PBXPath, hash_c_str, equal_to_c_str> PBXPath_map;
+    typedef std::unordered_map<ObjectKey, PBXPath, hash_object_key> PBXPath_map;
+    // indexes into PBXPath_map, values point to the nodes of the map
+    typedef std::unordered_map<const NeXTSTEP::Object*, const PBXPath*> PBXPath_objmap;
+    typedef std::unordered_multimap<const char*, const PBXPath*, hash_path_c_str, equal_to_path_c_str> PBXPath_pathmap;
+    typedef std::unordered_map<ObjectKey, PBXPath_pathmap, hash_object_key> PBXPath_childmap;
 
     struct ProjectItem {
         explicit ProjectItem(NeXTSTEP::Object* obj) : _obj(obj) {
         }
-        bool isa(const char* t) const {
-            if (_obj) {
-                const char* isa_ = _obj->stringByKey("isa");
-                return isa_ && strcmp(isa_, t) == 0;
-            }
-            return false;
+        bool isa(IsaType::Enum t) const {
+            return _obj && IsaType::Of(_obj) == t;
         }
         NeXTSTEP::Object* operator->() {
             return _obj;
@@ -195,12 +386,96 @@ namespace pbxproj {
     };
 
 
+    typedef std::unordered_map<ObjectKey, NeXTSTEP::KeyValue*, hash_object_key> KeyValue_map;
+
+    struct SnapshotReader;
+
     class Project {
+    public:
+        static const size_t kShardMinSize = 256 * 1024;
+        static const size_t kShardChunkSize = 64 * 1024;
+
+        // Batch of changes to the objects of a project: removes, adds and array
+        // rewrites are collected, validated and then applied in one pass.
+        // Nothing is changed when commit() fails.
+        class Edit {
+        public:
+            explicit Edit(Project& project) : _project(project) {
+            }
+            ~Edit();
+
+            // takes the ownership of kv
+            void add(NeXTSTEP::KeyValue* kv);
+            // takes the ownership of kv, a group or file indexed as a child of parent
+            void add(NeXTSTEP::KeyValue* kv, const PBXPath* parent, bool file);
+            void remove(const char* key);
+            bool removing(const ObjectKey& key) const {
+                return _removeKeys.find(key) != _removeKeys.end();
+            }
+            // set key of owner, an object inside item, to value in key order,
+            // takes the ownership of value, NULL removes key
+            void set(NeXTSTEP::Object* item, NeXTSTEP::Object* owner, const char* key, NeXTSTEP::Object* value);
+            // replace the values of array key of owner
+            void rewrite(NeXTSTEP::Object* owner, const char* key, std::vector<std::string>&& values);
+            // values of array key of owner to be rewritten, the current ones
+            // when not staged yet, NULL if owner has no such array
+            std::vector<std::string>* values(NeXTSTEP::Object* owner, const char* key);
+            // takes id for a new object if it is not used by an object kept
+            // or by another new one, ids of removed objects are free
+            bool takeId(const SId& id);
+
+            bool commit();
+            void clear();
+
+        private:
+            bool validate() const;
+
+            struct ArrayRewrite {
+                NeXTSTEP::Object* owner;
+                NeXTSTEP::Array* array;
+                std::vector<std::string> values;
+            };
+            struct ObjectSet {
+                NeXTSTEP::Object* item;
+                NeXTSTEP::Object* owner;
+                std::string key;
+                NeXTSTEP::Object* value;
+            };
+            struct PathAdd {
+                const NeXTSTEP::KeyValue* kv;
+                const char* parentKey;
+                bool file;
+            };
+
+            Project& _project;
+            std::vector<NeXTSTEP::KeyValue*> _adds;
+            std::vector<PathAdd> _paths;
+            // deque keeps the strings in place for _removeKeys
+            std::deque<std::string> _removes;
+            ObjectKey_set _removeKeys;
+            std::deque<ArrayRewrite> _rewrites;
+            std::vector<ObjectSet> _sets;
+            SId_set _ids;
+
+        private:
+            Edit(const Edit& other) = delete;
+            Edit& operator=(const Edit& other) = delete;
+        };
+
     public:
         Project();
 
-        bool inlineParse(char* src);
+        // jobs != 1 parses sections of a large project in parallel, 0 for hardware concurrency,
+        // original is the same text as src that stays unchanged as long as the
+        // project, a copy of src is kept when it is NULL
+        bool inlineParse(char* src, size_t jobs = 1, const char* original = NULL);
+        // load the parsed form of src saved by saveSnapshot(), false if the
+        // snapshot is missing, stale or corrupt, src is not changed
+        bool loadSnapshot(const char* file, char* src);
+        bool saveSnapshot(const char* file) const;
         void write(shared::StrBuf& buf) const;
+        // streams to out through a bounded buffer and closes it
+        bool write(FileWriterWithCheck& out) const;
 
         size_t targetCount() const {
             return _targets.size();
@@ -209,6 +484,10 @@ namespace pbxproj {
             return _targets[index];
         }
 
+        // changed since parsed, the written project would differ
+        bool modified() const {
+            return _modified;
+        }
         bool valid() const {
             return _project && _objects;
         }
@@ -217,23 +496,58 @@ namespace pbxproj {
         void debugDump(shared::StrBuf& buf) const;
 
     protected:
-        void writeObjects(shared::StrBuf& buf) const;
+        void write(shared::StrBuf& buf, FileWriterWithCheck* out) const;
+        void writeObjects(shared::StrBuf& buf, FileWriterWithCheck* out) const;
+        bool inlineParseSharded(char* src, size_t jobs);
+        // paths is false when the caller restores the paths, targets and project itself
+        bool buildIndex(bool verifySource, bool paths = true);
+        bool restorePaths(SnapshotReader& reader);
+        void clearIndex();
+        NeXTSTEP::Object* object(const char* key) const;
+        Section* findSection(const char* type);
+        Section* findSection(const NeXTSTEP::Object* obj);
+        // section of a known isa, an empty one is added in name order when missing
+        Section* ensureSection(IsaType::Enum isa);
         const PBXPath* findGroupOrFilePath(NeXTSTEP::Object* obj) const;
         const PBXPath* findGroupOrFilePath(const char* fullpath) const;
-        bool addItem(NeXTSTEP::KeyValue* kv);
-        void removeItem(const char* key);
+        const PBXPath* findChildGroupOrFilePath(const PBXPath* parent, const char* path, bool file) const;
+        const PBXPath* insertPath(const char* key, PBXPath&& path);
+        // erases the path of key, the paths of the children of a group with it
+        void erasePath(const char* key);
+        void sortObjects();
+        // obj is changed in place, write it out again instead of copying its parsed text
+        void touch(const NeXTSTEP::Object* obj);
 
     protected:
+        // strings of _plist point into it when loaded from a snapshot
+        MappedFile _snapshot;
         NeXTSTEP::PList _plist;
+        // the data before inlineParse, parsed text of untouched objects is copied from it
+        const char* _source;
+        size_t _sourceLength;
+        // owns _source when no original is given to inlineParse
+        std::string _sourceCopy;
+        const char* _sourceData;
+        std::unordered_set<const NeXTSTEP::Object*> _touched;
 
         // objects
         std::vector<Section> _sections;
+        // index in _sections of known isa types, -1 for none
+        int32_t _sectionByIsa[IsaType::Count];
 
         NeXTSTEP::Object* _project;
         NeXTSTEP::Object* _objects;
+        KeyValue_map _objectmap;
+        // items added after parse are appended to _objects, sortObjects() restores the section order
+        bool _objectsSorted;
+        // objects were added, removed or touched since parsed
+        bool _modified;
         std::vector<NeXTSTEP::Object*> _targets;
 
         PBXPath_map _pathmap;
+        PBXPath_objmap _pathByObject;
+        PBXPath_pathmap _pathByFullpath;
+        PBXPath_childmap _pathByParent;
     };
 
 